@@ -14,6 +14,16 @@ V = @
 #
 # GCCPREFIX=''
 
+# Uncomment the following line to build the kernel with PAE paging: 64-bit
+# page table entries, 36-bit physical addresses and 2MB large pages.
+#
+# PAE=1
+
+# Uncomment the following line to send console output only to the QEMU
+# debug port (0xE9); 'make qemu' then logs it to debugcon.log.
+#
+# DEBUGCON=1
+
 # If the makefile cannot find your QEMU binary, uncomment the
 # following line and set it to the full path to QEMU.
 #
@@ -42,11 +42,14 @@
  *                     |      Invalid Memory (*)      | --/--  KSTKGAP    |
  *                     +------------------------------+                   |
  *                     :              .               :                   |
- *                     :              .               :                   |
- *    MMIOLIM ------>  +------------------------------+ 0xefc00000      --+
+ *    KMAPLIM ------>  +------------------------------+ 0xeff80000        |
+ *                     |   Per-CPU kmap Slot Windows  | RW/--             |
+ * KMAPBASE,VMALLOCLIM +------------------------------+ 0xeff00000        |
+ *                     |     vmalloc Area (Kernel)    | RW/--             |
+ * MMIOLIM,VMALLOCBASE +------------------------------+ 0xefc00000      --+
  *                     |       Memory-mapped I/O      | RW/--  PTSIZE
  * ULIM, MMIOBASE -->  +------------------------------+ 0xef800000
- *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
+ *                     |  Cur. Page Table (User R-)   | R-/R-  UVPTSIZE
  *    UVPT      ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
@@ -80,6 +83,11 @@
  * (*) Note: The kernel ensures that "Invalid Memory" is *never* mapped.
  *     "Empty Memory" is normally unmapped, but user programs may map pages
  *     there if desired.  JOS user programs map pages temporarily at UTEMP.
+ *
+ * The addresses shown are for the default build.  A PAE kernel (JOS_PAE) has
+ * a 2MB PTSIZE, so the regions sized in PTSIZE shrink, and an 8MB UVPT.  Its
+ * RO PAGES region is UPAGESSIZE = 16MB, enough page_info's for the 4GB and
+ * more that PAE is for.
  */
 
 
@@ -92,6 +100,9 @@
 #define IOPHYSMEM   0x0A0000
 #define EXTPHYSMEM  0x100000
 
+/* Maximum number of CPUs, each with a kernel stack below KSTACKTOP. */
+#define NCPU        8
+
 /* Kernel stack. */
 #define KSTACKTOP   KERNBASE
 #define KSTKSIZE    (8*PGSIZE)          /* size of a kernel stack */
@@ -101,6 +112,17 @@
 #define MMIOLIM     (KSTACKTOP - PTSIZE)
 #define MMIOBASE    (MMIOLIM - PTSIZE)
 
+/* Temporary mappings of pages outside the direct map at KERNBASE (kmap in
+ * kern/pmap.c): KMAP_NSLOTS pages per CPU, just below the kernel stacks. */
+#define KMAP_NSLOTS 16
+#define KMAPLIM     (KSTACKTOP - NCPU * (KSTKSIZE + KSTKGAP))
+#define KMAPBASE    (KMAPLIM - NCPU * KMAP_NSLOTS * PGSIZE)
+
+/* Virtually contiguous kernel allocations (kern/vmalloc.c) use the rest of
+ * the kernel stack region. */
+#define VMALLOCBASE MMIOLIM
+#define VMALLOCLIM  KMAPBASE
+
 #define ULIM        (MMIOBASE)
 
 /*
@@ -108,10 +130,19 @@
  * They are global pages mapped in at env allocation time.
  */
 
-/* User read-only virtual page table (see 'uvpt' below) */
-#define UVPT        (ULIM - PTSIZE)
+/* User read-only virtual page table (see 'uvpt' below): one page table's
+ * worth of address space per page of the page directory */
+#define UVPTSIZE    (NPDENTRIES * PTESIZE / PGSIZE * PTSIZE)
+#define UVPT        (ULIM - UVPTSIZE)
 /* Read-only copies of the Page structures */
-#define UPAGES      (UVPT - PTSIZE)
+#ifdef JOS_PAE
+#define UPAGESSIZE  (8 * PTSIZE)
+#else
+#define UPAGESSIZE  PTSIZE
+#endif
+#define UPAGES      (UVPT - UPAGESSIZE)
+/* Read-only allocator statistics (struct page_stats), top page of UPAGES */
+#define UPAGESTATS  (UVPT - PGSIZE)
 /* Read-only copies of the global env structures */
 #define UENVS       (UPAGES - PTSIZE)
 
@@ -140,10 +171,14 @@
 
 #ifndef __ASSEMBLER__
 
+#ifdef JOS_PAE
+typedef uint64_t pte_t;
+typedef uint64_t pde_t;
+#else
 typedef uint32_t pte_t;
 typedef uint32_t pde_t;
+#endif
 
-#if JOS_USER
 /*
  * The page directory entry corresponding to the virtual address range
  * [UVPT, UVPT + PTSIZE) points to the page directory itself.  Thus, the page
@@ -157,10 +192,13 @@ typedef uint32_t pde_t;
  * A second consequence is that the contents of the current page directory
  * will always be available at virtual address (UVPT + (UVPT >> PGSHIFT)), to
  * which uvpd is set in entry.S.
+ *
+ * Under PAE the page directory is four pages, each mapped as a page table of
+ * its own, so the virtual page table takes UVPTSIZE = 4 * PTSIZE and uvpd is
+ * at UVPT + (UVPT >> PGSHIFT) * PTESIZE.
  */
 extern volatile pte_t uvpt[];     /* VA of "virtual page table" */
 extern volatile pde_t uvpd[];     /* VA of current page directory */
-#endif
 
 /*
  * Page descriptor structures, mapped at UPAGES.
@@ -182,6 +220,44 @@ struct page_info {
      * boot_alloc do not have valid reference count fields. */
 
     uint16_t pp_ref;
+
+    /* PP_* flags below. */
+    uint16_t pp_flags;
+};
+
+/* Values for pp_flags */
+#define PP_FREE     0x0001  /* on the free list */
+#define PP_MOVABLE  0x0002  /* only referenced from PTEs; may be migrated */
+
+/*
+ * Physical allocator statistics, mapped read-only at UPAGESTATS.
+ *
+ * ps_version is bumped whenever this layout changes.  Each counter is
+ * updated atomically on its own, but page_alloc and page_free run lock-free
+ * on every CPU, so the counters are approximate with respect to each other:
+ * a reader may see an allocation counted in ps_nalloc before it leaves
+ * ps_nfree.  They are exact whenever the allocator is idle.
+ */
+#define PAGE_STATS_VERSION  4
+
+/* Zones of physical memory that free pages are counted in. */
+enum {
+    PZONE_BASE,     /* [0, EXTPHYSMEM) */
+    PZONE_EXT,      /* [EXTPHYSMEM, end of the direct map at KERNBASE) */
+    PZONE_HIGH,     /* beyond the direct map; reached through kmap */
+    NPZONES
+};
+
+struct page_stats {
+    uint32_t ps_version;
+    uint32_t ps_npages;             /* physical pages, holes included */
+    uint32_t ps_npage_infos;        /* struct page_info's at UPAGES */
+    uint32_t ps_nfree[NPZONES];     /* free pages per zone */
+    uint32_t ps_nalloc;             /* successful page_alloc calls */
+    uint32_t ps_nalloc_failed;      /* page_alloc calls that found no page */
+    uint32_t ps_nalloc_zero;        /* page_alloc calls with ALLOC_ZERO */
+    uint32_t ps_nfree_calls;        /* page_free calls */
+    uint32_t ps_nmerged;            /* pages saved by same-page merging */
 };
 
 #endif /* !__ASSEMBLER__ */
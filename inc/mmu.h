@@ -28,15 +28,49 @@
  * use PGADDR(PDX(la), PTX(la), PGOFF(la)).
  */
 
+/*
+ * With PAE paging (a kernel built with JOS_PAE), entries are 64 bits wide, so
+ * a page table or directory holds only 512 of them, and a fourth level, the
+ * four-entry page directory pointer table, sits on top:
+ *
+ * +-2-+-----9------+-------9--------+---------12----------+
+ * |PDP|   Page     |   Page Table   | Offset within Page  |
+ * |   | Directory  |      Index     |                     |
+ * +---+------------+----------------+---------------------+
+ *  \----- PDX(la) / \--- PTX(la) --/ \---- PGOFF(la) ----/
+ *
+ * The kernel allocates the four page directories back to back and treats
+ * them as one 2048-entry directory, so PDX(la) spans the PDPX bits too and
+ * code indexing a 'pde_t *pgdir' by PDX(la) works unchanged.
+ */
+
 /* page number field of address */
 #define PGNUM(la)   (((uintptr_t) (la)) >> PTXSHIFT)
 
+/* page number of a physical address */
+#define PPN(pa)     ((ppn_t) (((physaddr_t) (pa)) >> PGSHIFT))
+
+#ifdef JOS_PAE
+
+/* page directory index, across all four page directories */
+#define PDX(la)     ((((uintptr_t) (la)) >> PDXSHIFT) & 0x7FF)
+
+/* page table index */
+#define PTX(la)     ((((uintptr_t) (la)) >> PTXSHIFT) & 0x1FF)
+
+/* page directory pointer table index */
+#define PDPX(la)    (((uintptr_t) (la)) >> PDPXSHIFT)
+
+#else
+
 /* page directory index */
 #define PDX(la)     ((((uintptr_t) (la)) >> PDXSHIFT) & 0x3FF)
 
 /* page table index */
 #define PTX(la)     ((((uintptr_t) (la)) >> PTXSHIFT) & 0x3FF)
 
+#endif /* !JOS_PAE */
+
 /* offset in page */
 #define PGOFF(la)   (((uintptr_t) (la)) & 0xFFF)
 
@@ -44,17 +78,31 @@
 #define PGADDR(d, t, o) ((void*) ((d) << PDXSHIFT | (t) << PTXSHIFT | (o)))
 
 /* Page directory and page table constants. */
+#ifdef JOS_PAE
+#define NPDPENTRIES 4           /* page directory pointer table entries */
+#define NPDENTRIES  2048        /* PDEs in all four page directories */
+#define NPTENTRIES  512         /* page table entries per page table */
+#define PTESIZE     8           /* bytes per page table entry */
+#else
 #define NPDENTRIES  1024        /* page directory entries per page directory */
 #define NPTENTRIES  1024        /* page table entries per page table */
+#define PTESIZE     4           /* bytes per page table entry */
+#endif
 
 #define PGSIZE      4096        /* bytes mapped by a page */
 #define PGSHIFT     12      /* log2(PGSIZE) */
 
 #define PTSIZE      (PGSIZE*NPTENTRIES) /* bytes mapped by a page directory entry */
-#define PTSHIFT     22      /* log2(PTSIZE) */
 
 #define PTXSHIFT    12      /* offset of PTX in a linear address */
+#ifdef JOS_PAE
+#define PTSHIFT     21      /* log2(PTSIZE) */
+#define PDXSHIFT    21      /* offset of PDX in a linear address */
+#define PDPXSHIFT   30      /* offset of PDPX in a linear address */
+#else
+#define PTSHIFT     22      /* log2(PTSIZE) */
 #define PDXSHIFT    22      /* offset of PDX in a linear address */
+#endif
 
 /* Page table/directory entry flags. */
 #define PTE_P       0x001   /* Present */
@@ -71,11 +119,18 @@
  * hardware, so user processes are allowed to set them arbitrarily. */
 #define PTE_AVAIL   0xE00   /* Available for software use */
 
+/* Software PTE bits the kernel itself uses, carved out of PTE_AVAIL. */
+#define PTE_COW     0x800   /* Copy-on-write: read-only, copy on write fault */
+
 /* Flags in PTE_SYSCALL may be used in system calls.  (Others may not.) */
 #define PTE_SYSCALL (PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
 /* Address in page table or page directory entry */
+#ifdef JOS_PAE
+#define PTE_ADDR(pte)   ((physaddr_t) (pte) & 0x000FFFFFFFFFF000ULL)
+#else
 #define PTE_ADDR(pte)   ((physaddr_t) (pte) & ~0xFFF)
+#endif
 
 /* Control Register flags */
 #define CR0_PE      0x00000001  /* Protection Enable */
@@ -91,7 +146,9 @@
 #define CR0_PG      0x80000000  /* Paging */
 
 #define CR4_PCE     0x00000100  /* Performance counter enable */
+#define CR4_PGE     0x00000080  /* Page Global Enable */
 #define CR4_MCE     0x00000040  /* Machine Check Enable */
+#define CR4_PAE     0x00000020  /* Physical Address Extension */
 #define CR4_PSE     0x00000010  /* Page Size Extensions */
 #define CR4_DE      0x00000008  /* Debugging Extensions */
 #define CR4_TSD     0x00000004  /* Time Stamp Disable */
@@ -30,10 +30,15 @@ static __inline uint32_t rcr4(void) __attribute__((always_inline));
 static __inline void tlbflush(void) __attribute__((always_inline));
 static __inline uint32_t read_eflags(void) __attribute__((always_inline));
 static __inline void write_eflags(uint32_t eflags) __attribute__((always_inline));
+static __inline uint32_t irq_save(void) __attribute__((always_inline));
+static __inline void irq_restore(uint32_t eflags) __attribute__((always_inline));
 static __inline uint32_t read_ebp(void) __attribute__((always_inline));
 static __inline uint32_t read_esp(void) __attribute__((always_inline));
 static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
 static __inline uint64_t read_tsc(void) __attribute__((always_inline));
+static __inline uint64_t rdmsr(uint32_t msr) __attribute__((always_inline));
+static __inline void wrmsr(uint32_t msr, uint64_t val) __attribute__((always_inline));
+static __inline void wc_flush(void) __attribute__((always_inline));
 
 static __inline void breakpoint(void)
 {
@@ -211,6 +216,21 @@ static __inline void write_eflags(uint32_t eflags)
     __asm __volatile("pushl %0; popfl" : : "r" (eflags));
 }
 
+/* Disable interrupts and return the old eflags, for irq_restore. */
+static __inline uint32_t irq_save(void)
+{
+    uint32_t eflags = read_eflags();
+    __asm __volatile("cli" : : : "memory");
+    return eflags;
+}
+
+/* Re-enable interrupts if they were on at the matching irq_save. */
+static __inline void irq_restore(uint32_t eflags)
+{
+    __asm __volatile("" : : : "memory");
+    write_eflags(eflags);
+}
+
 static __inline uint32_t read_ebp(void)
 {
     uint32_t ebp;
@@ -249,6 +269,26 @@ static __inline uint64_t read_tsc(void)
     return tsc;
 }
 
+static __inline uint64_t rdmsr(uint32_t msr)
+{
+    uint64_t val;
+    __asm __volatile("rdmsr" : "=A" (val) : "c" (msr));
+    return val;
+}
+
+static __inline void wrmsr(uint32_t msr, uint64_t val)
+{
+    __asm __volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
+/* Drain the write-combining buffers, so that earlier writes through a WC
+ * mapping reach memory.  Any locked instruction does; unlike sfence it
+ * needs no SSE. */
+static __inline void wc_flush(void)
+{
+    __asm __volatile("lock; addl $0,0(%%esp)" : : : "memory", "cc");
+}
+
 static inline uint32_t xchg(volatile uint32_t *addr, uint32_t newval)
 {
     uint32_t result;
@@ -261,4 +301,43 @@ static inline uint32_t xchg(volatile uint32_t *addr, uint32_t newval)
     return result;
 }
 
+/* Atomically add 'delta' to *addr and return the previous value. */
+static inline uint32_t atomic_add(volatile uint32_t *addr, uint32_t delta)
+{
+    asm volatile("lock; xaddl %0, %1" :
+            "+r" (delta), "+m" (*addr) :
+            :
+            "cc");
+    return delta;
+}
+
+/* Add 'delta' to *addr and return the previous value, as one instruction
+ * but without the lock prefix: atomic against interrupts on this CPU only,
+ * for per-CPU data. */
+static inline uint32_t local_add(volatile uint32_t *addr, uint32_t delta)
+{
+    asm volatile("xaddl %0, %1" :
+            "+r" (delta), "+m" (*addr) :
+            :
+            "cc");
+    return delta;
+}
+
+/* If *addr equals *expected, atomically replace it with 'newval' and return
+ * true.  Otherwise store the current value of *addr in *expected and return
+ * false. */
+static inline bool cmpxchg8b(volatile uint64_t *addr, uint64_t *expected,
+        uint64_t newval)
+{
+    uint64_t prev = *expected;
+    bool ok;
+
+    asm volatile("lock; cmpxchg8b %1; sete %2" :
+            "+A" (prev), "+m" (*addr), "=q" (ok) :
+            "b" ((uint32_t) newval), "c" ((uint32_t) (newval >> 32)) :
+            "cc", "memory");
+    *expected = prev;
+    return ok;
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -5,8 +5,11 @@
 #include <inc/kbdreg.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/error.h>
 
 #include <kern/console.h>
+#include <kern/pmap.h>
+#include <kern/klog.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -30,8 +33,14 @@ static void delay(void)
 #define COM_DLM         1   /* Out: Divisor Latch High (DLAB=1) */
 #define COM_IER         1   /* Out: Interrupt Enable Register */
 #define   COM_IER_RDI   0x01    /*   Enable receiver data interrupt */
+#define   COM_IER_TXI   0x02    /*   Enable transmitter empty interrupt */
 #define COM_IIR         2   /* In:  Interrupt ID Register */
+#define   COM_IIR_FIFO  0xC0    /*   FIFOs enabled (16550A) */
 #define COM_FCR         2   /* Out: FIFO Control Register */
+#define   COM_FCR_ENABLE 0x01   /*   Enable the FIFOs */
+#define   COM_FCR_RCLR  0x02    /*   Clear the receive FIFO */
+#define   COM_FCR_TCLR  0x04    /*   Clear the transmit FIFO */
+#define   COM_FCR_TRIG8 0x80    /*   Receive interrupt at 8 bytes */
 #define COM_LCR         3   /* Out: Line Control Register */
 #define   COM_LCR_DLAB  0x80    /*   Divisor latch access bit */
 #define   COM_LCR_WLEN8 0x03    /*   Wordlength: 8 bits */
@@ -44,7 +53,32 @@ static void delay(void)
 #define   COM_LSR_TXRDY 0x20    /*   Transmit buffer avail */
 #define   COM_LSR_TSRE  0x40    /*   Transmitter off */
 
+#define COM_CLOCK       115200  /* divisor 1 */
+#define COM_FIFOSIZE    16      /* 16550A transmit FIFO depth */
+
+#ifndef SERIAL_BAUD
+#define SERIAL_BAUD     COM_CLOCK
+#endif
+
 static bool serial_exists;
+static uint8_t serial_ier;
+static unsigned serial_baud;
+/* Bytes the UART takes each time it reports TXRDY: once THRE is set the
+ * whole transmit FIFO is empty. */
+static unsigned serial_txburst = 1;
+
+/* Bytes waiting to go out on COM1.  cons_putc only queues them here; the
+ * THRE interrupt (and any polling of serial_intr) hands them to the UART.
+ * getchar drains the ring before it waits for input, and panic before it
+ * stops; anything queued when the kernel hangs elsewhere with interrupts
+ * off is lost, so serial output is best-effort until one of those runs. */
+#define SERIAL_TXBUFSIZE 1024   /* power of 2 */
+
+static struct {
+    uint8_t buf[SERIAL_TXBUFSIZE];
+    uint32_t rpos;  /* free-running; index with % SERIAL_TXBUFSIZE */
+    uint32_t wpos;
+} serial_tx;
 
 static int serial_proc_data(void)
 {
@@ -53,13 +87,39 @@ static int serial_proc_data(void)
     return inb(COM1+COM_RX);
 }
 
-void serial_intr(void)
+static void serial_set_ier(uint8_t ier)
 {
-    if (serial_exists)
-        cons_intr(serial_proc_data);
+    if (ier != serial_ier) {
+        serial_ier = ier;
+        outb(COM1+COM_IER, ier);
+    }
+}
+
+/* Hand the UART up to a FIFO's worth of queued bytes.  Only call once
+ * TXRDY has been seen. */
+static void serial_tx_burst(void)
+{
+    unsigned n;
+
+    for (n = 0; n < serial_txburst && serial_tx.rpos != serial_tx.wpos; n++)
+        outb(COM1+COM_TX, serial_tx.buf[serial_tx.rpos++ % SERIAL_TXBUFSIZE]);
+}
+
+/* Give the UART as many queued bytes as it will take without waiting, and
+ * leave the THRE interrupt enabled only while bytes remain.  Called with
+ * interrupts off. */
+static void serial_tx_start(void)
+{
+    while (serial_tx.rpos != serial_tx.wpos &&
+           (inb(COM1+COM_LSR) & COM_LSR_TXRDY))
+        serial_tx_burst();
+
+    serial_set_ier(COM_IER_RDI |
+                   (serial_tx.rpos != serial_tx.wpos ? COM_IER_TXI : 0));
 }
 
-static void serial_putc(int c)
+/* Spin until the transmit holding register is free (or we give up). */
+static void serial_tx_wait(void)
 {
     int i;
 
@@ -67,34 +127,148 @@ static void serial_putc(int c)
          !(inb(COM1 + COM_LSR) & COM_LSR_TXRDY) && i < 12800;
          i++)
         delay();
+}
+
+/* Push out everything in the TX ring by polling.  For contexts that can't
+ * rely on the THRE interrupt, such as panic. */
+void serial_flush(void)
+{
+    uint32_t eflags = irq_save();
+
+    while (serial_tx.rpos != serial_tx.wpos) {
+        serial_tx_wait();
+        serial_tx_burst();
+    }
+    serial_set_ier(COM_IER_RDI);
+    irq_restore(eflags);
+}
+
+void serial_intr(void)
+{
+    uint32_t eflags;
+
+    if (!serial_exists)
+        return;
+    cons_intr(serial_proc_data);
+
+    eflags = irq_save();
+    serial_tx_start();
+    irq_restore(eflags);
+}
+
+static void serial_write(const char *buf, size_t len)
+{
+    uint32_t eflags;
+    size_t i;
+
+    eflags = irq_save();
+    for (i = 0; i < len; i++) {
+        /* Ring full: make room by hand rather than drop output. */
+        if (serial_tx.wpos - serial_tx.rpos == SERIAL_TXBUFSIZE) {
+            serial_tx_wait();
+            serial_tx_burst();
+        }
+        serial_tx.buf[serial_tx.wpos++ % SERIAL_TXBUFSIZE] = buf[i];
+    }
+    irq_restore(eflags);
+
+    /* After a panic nothing may ever drain the ring; write through. */
+    if (panicstr) {
+        serial_flush();
+        return;
+    }
 
-    outb(COM1 + COM_TX, c);
+    eflags = irq_save();
+    serial_tx_start();
+    irq_restore(eflags);
 }
 
-static void serial_init(void)
+/* Program the divisor latch for 'baud', which must divide COM_CLOCK.
+ * Anything still queued goes out at the old rate first. */
+int serial_set_baud(unsigned baud)
 {
-    /* Turn off the FIFO */
-    outb(COM1+COM_FCR, 0);
+    unsigned divisor;
+    int i;
+
+    if (baud == 0 || baud > COM_CLOCK || COM_CLOCK % baud)
+        return -E_INVAL;
+    divisor = COM_CLOCK / baud;
+    if (divisor > 0xFFFF)
+        return -E_INVAL;
+
+    serial_flush();
+    for (i = 0; !(inb(COM1+COM_LSR) & COM_LSR_TSRE) && i < 12800; i++)
+        delay();
 
     /* Set speed; requires DLAB latch */
     outb(COM1+COM_LCR, COM_LCR_DLAB);
-    outb(COM1+COM_DLL, (uint8_t) (115200 / 9600));
-    outb(COM1+COM_DLM, 0);
+    outb(COM1+COM_DLL, (uint8_t) divisor);
+    outb(COM1+COM_DLM, (uint8_t) (divisor >> 8));
 
     /* 8 data bits, 1 stop bit, parity off; turn off DLAB latch */
     outb(COM1+COM_LCR, COM_LCR_WLEN8 & ~COM_LCR_DLAB);
 
-    /* No modem controls */
-    outb(COM1+COM_MCR, 0);
-    /* Enable rcv interrupts */
-    outb(COM1+COM_IER, COM_IER_RDI);
+    serial_baud = baud;
+    return 0;
+}
+
+unsigned serial_get_baud(void)
+{
+    return serial_baud;
+}
+
+/* Send 'nbytes' bytes of filler through the TX ring and wait until the last
+ * one has left the shift register.  Stores the TSC cycles taken in *cycles
+ * and returns the number of bytes sent, or 0 without a serial port. */
+size_t serial_bench(size_t nbytes, uint64_t *cycles)
+{
+    char line[64];
+    uint64_t start;
+    size_t i;
+    int j;
+
+    if (!serial_exists)
+        return 0;
+
+    memset(line, '.', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\n';
+
+    serial_flush();
+    start = read_tsc();
+    for (i = 0; i < nbytes; i += sizeof(line))
+        serial_write(line, MIN(sizeof(line), nbytes - i));
+    serial_flush();
+    for (j = 0; !(inb(COM1+COM_LSR) & COM_LSR_TSRE) && j < 12800; j++)
+        delay();
+    *cycles = read_tsc() - start;
+    return nbytes;
+}
+
+static bool serial_init(void)
+{
+    /* Turn on and reset the FIFOs */
+    outb(COM1+COM_FCR, COM_FCR_ENABLE | COM_FCR_RCLR | COM_FCR_TCLR |
+                       COM_FCR_TRIG8);
+
+    serial_set_baud(SERIAL_BAUD);
+
+    /* No modem controls; OUT2 gates the UART's interrupt line */
+    outb(COM1+COM_MCR, COM_MCR_OUT2);
+    /* Enable rcv interrupts; serial_tx_start turns on xmit ones on demand */
+    serial_ier = COM_IER_RDI;
+    outb(COM1+COM_IER, serial_ier);
 
     /* Clear any preexisting overrun indications and interrupts
      * Serial port doesn't exist if COM_LSR returns 0xFF */
     serial_exists = (inb(COM1+COM_LSR) != 0xFF);
-    (void) inb(COM1+COM_IIR);
+    /* Only a 16550A reports working FIFOs; older parts have a 1-byte THR */
+    if ((inb(COM1+COM_IIR) & COM_IIR_FIFO) == COM_IIR_FIFO)
+        serial_txburst = COM_FIFOSIZE;
+    else
+        outb(COM1+COM_FCR, 0);
     (void) inb(COM1+COM_RX);
 
+    return serial_exists;
 }
 
 
@@ -114,6 +288,45 @@ static void lpt_putc(int c)
     outb(0x378+2, 0x08);
 }
 
+static void lpt_write(const char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        lpt_putc(buf[i]);
+}
+
+static bool lpt_init(void)
+{
+    /* A present port latches what we write to its data register; a missing
+     * one floats to 0xFF */
+    outb(0x378+0, 0xAA);
+    return inb(0x378+0) == 0xAA;
+}
+
+
+
+
+/***** Bochs/QEMU debug port output *****/
+/* Every byte written to port 0xE9 lands in the emulator's debugcon chardev.
+ * There is nothing to poll, so a character costs a single outb. */
+
+#define DEBUGCON_PORT   0xE9
+
+static bool debugcon_exists;
+
+static void debugcon_write(const char *buf, size_t len)
+{
+    outsb(DEBUGCON_PORT, buf, len);
+}
+
+static bool debugcon_init(void)
+{
+    /* The port reads back 0xE9 when it is there */
+    debugcon_exists = (inb(DEBUGCON_PORT) == DEBUGCON_PORT);
+    return debugcon_exists;
+}
+
 
 
 
@@ -123,7 +336,25 @@ static unsigned addr_6845;
 static uint16_t *crt_buf;
 static uint16_t crt_pos;
 
-static void cga_init(void)
+/* Characters are drawn into crt_shadow, in ordinary memory, and only the
+ * rows marked in crt_dirty are copied out to crt_buf by cga_sync.
+ * crt_cursor is where the CRTC was last told the cursor is.
+ *
+ * The screen is a window onto text memory starting crt_start characters
+ * into crt_buf.  Scrolling moves the window down a row rather than copying
+ * the screen; crt_nscroll counts the rows cga_sync still has to move it.
+ * Only when the window would run off the end of text memory is the screen
+ * copied back to the start. */
+static uint16_t crt_shadow[CRT_SIZE];
+static uint32_t crt_dirty;
+static uint16_t crt_cursor;
+static uint16_t crt_start;
+static unsigned crt_nscroll;
+
+#define CRT_ROWMASK(row)    ((uint32_t) 1 << (row))
+#define CRT_ALLROWS         (CRT_ROWMASK(CRT_ROWS) - 1)
+
+static bool cga_init(void)
 {
     volatile uint16_t *cp;
     uint16_t was;
@@ -140,18 +371,42 @@ static void cga_init(void)
         addr_6845 = CGA_BASE;
     }
 
-    /* Extract cursor location */
+    /* Extract the start address and cursor location */
+    outb(addr_6845, 12);
+    crt_start = inb(addr_6845 + 1) << 8;
+    outb(addr_6845, 13);
+    crt_start |= inb(addr_6845 + 1);
+    if (crt_start > CRT_MEMSIZE - CRT_SIZE)
+        crt_start = 0;
+
     outb(addr_6845, 14);
     pos = inb(addr_6845 + 1) << 8;
     outb(addr_6845, 15);
     pos |= inb(addr_6845 + 1);
 
     crt_buf = (uint16_t*) cp;
-    crt_pos = pos;
+    crt_cursor = pos;
+    crt_pos = pos >= crt_start && pos < crt_start + CRT_SIZE ?
+              pos - crt_start : 0;
+
+    /* Start the shadow off with whatever the BIOS left on the screen */
+    memmove(crt_shadow, crt_buf + crt_start, sizeof(crt_shadow));
+    return true;
+}
+
+/* Switch crt_buf from the uncached mapping at KERNBASE to a
+ * write-combining mapping of the VGA window, so that screen updates go out
+ * as burst writes. */
+static void cga_mem_init(void)
+{
+    char *vga = mmio_map_region(VGA_BUF, VGA_BUFSIZE, MEMTYPE_WC);
+
+    crt_buf = (uint16_t *) (vga + ((uintptr_t) crt_buf - KERNBASE - VGA_BUF));
 }
 
 
 
+/* Put one character into the shadow buffer. */
 static void cga_putc(int c)
 {
     /* If no attribute given, then use black on white. */
@@ -162,7 +417,8 @@ static void cga_putc(int c)
     case '\b':
         if (crt_pos > 0) {
             crt_pos--;
-            crt_buf[crt_pos] = (c & ~0xff) | ' ';
+            crt_shadow[crt_pos] = (c & ~0xff) | ' ';
+            crt_dirty |= CRT_ROWMASK(crt_pos / CRT_COLS);
         }
         break;
     case '\n':
@@ -172,32 +428,89 @@ static void cga_putc(int c)
         crt_pos -= (crt_pos % CRT_COLS);
         break;
     case '\t':
-        cons_putc(' ');
-        cons_putc(' ');
-        cons_putc(' ');
-        cons_putc(' ');
-        cons_putc(' ');
+        cga_putc(' ');
+        cga_putc(' ');
+        cga_putc(' ');
+        cga_putc(' ');
+        cga_putc(' ');
         break;
     default:
-        crt_buf[crt_pos++] = c;     /* write the character */
+        crt_dirty |= CRT_ROWMASK(crt_pos / CRT_COLS);
+        crt_shadow[crt_pos++] = c;  /* write the character */
         break;
     }
 
-    /* What is the purpose of this? */
+    /* Scroll up a line once we run off the bottom */
     if (crt_pos >= CRT_SIZE) {
         int i;
 
-        memmove(crt_buf, crt_buf + CRT_COLS, (CRT_SIZE - CRT_COLS) * sizeof(uint16_t));
+        memmove(crt_shadow, crt_shadow + CRT_COLS,
+                (CRT_SIZE - CRT_COLS) * sizeof(uint16_t));
         for (i = CRT_SIZE - CRT_COLS; i < CRT_SIZE; i++)
-            crt_buf[i] = 0x0700 | ' ';
+            crt_shadow[i] = 0x0700 | ' ';
         crt_pos -= CRT_COLS;
+
+        /* Rows already on screen move up with the window; only the new
+         * bottom row has to be written */
+        crt_dirty = (crt_dirty >> 1) | CRT_ROWMASK(CRT_ROWS - 1);
+        crt_nscroll++;
     }
+}
 
-    /* move that little blinky thing */
-    outb(addr_6845, 14);
-    outb(addr_6845 + 1, crt_pos >> 8);
-    outb(addr_6845, 15);
-    outb(addr_6845 + 1, crt_pos);
+/* Scroll the window, copy the dirty rows of the shadow to the screen, a
+ * run of rows at a time, and then move the cursor if it has changed. */
+static void cga_sync(void)
+{
+    uint16_t *screen;
+    int row, nrows;
+    bool moved = crt_nscroll != 0;
+
+    if (moved) {
+        if (crt_start + (crt_nscroll * CRT_COLS) > CRT_MEMSIZE - CRT_SIZE) {
+            /* Out of text memory: wrap around to the start */
+            crt_start = 0;
+            crt_dirty = CRT_ALLROWS;
+        } else
+            crt_start += crt_nscroll * CRT_COLS;
+        crt_nscroll = 0;
+    }
+
+    screen = crt_buf + crt_start;
+    for (row = 0; crt_dirty; row += nrows, crt_dirty >>= nrows) {
+        for (nrows = 0; crt_dirty & CRT_ROWMASK(nrows); nrows++)
+            /* count the run */;
+        if (nrows == 0) {
+            nrows = 1;
+            continue;
+        }
+        memmove(screen + row * CRT_COLS, crt_shadow + row * CRT_COLS,
+                nrows * CRT_COLS * sizeof(uint16_t));
+    }
+
+    /* make the writes visible before the window or cursor moves */
+    wc_flush();
+
+    /* Set the start address and the cursor, which is relative to text
+     * memory rather than to the window.  Index in the low byte, data in
+     * the high byte: one outw per register. */
+    if (moved) {
+        outw(addr_6845, 12 | (crt_start & 0xFF00));
+        outw(addr_6845, 13 | (crt_start << 8));
+    }
+    if (crt_start + crt_pos != crt_cursor) {
+        crt_cursor = crt_start + crt_pos;
+        outw(addr_6845, 14 | (crt_cursor & 0xFF00));
+        outw(addr_6845, 15 | (crt_cursor << 8));
+    }
+}
+
+static void cga_write(const char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        cga_putc((uint8_t) buf[i]);
+    cga_sync();
 }
 
 
@@ -411,23 +724,85 @@ int cons_getc(void)
     return 0;
 }
 
+/* The output devices.  Each is probed once by cons_init; output only ever
+ * goes to the ones that were found and are switched on. */
+struct cons_dev cons_devs[] = {
+    { "serial", serial_init, serial_write },
+    { "lpt", lpt_init, lpt_write },
+    { "cga", cga_init, cga_write },
+    { "debugcon", debugcon_init, debugcon_write },
+};
+const int ncons_devs = sizeof(cons_devs) / sizeof(cons_devs[0]);
+
+/* Output 'len' bytes to the console, handing each device the whole run. */
+void cons_write(const char *buf, size_t len)
+{
+    struct cons_dev *cd;
+    uint64_t start;
+
+    if (len == 0)
+        return;
+    for (cd = cons_devs; cd < cons_devs + ncons_devs; cd++) {
+        /* A panic goes everywhere it can */
+        if (!cd->cd_present || (!cd->cd_enabled && !panicstr))
+            continue;
+        start = read_tsc();
+        cd->cd_write(buf, len);
+        cd->cd_cycles += read_tsc() - start;
+        cd->cd_nbytes += len;
+    }
+}
+
 /* Output a character to the console. */
 static void cons_putc(int c)
 {
-    serial_putc(c);
-    lpt_putc(c);
-    cga_putc(c);
+    char ch = c;
+
+    cons_write(&ch, 1);
+}
+
+/* Switch output to the named device on or off. */
+int cons_enable(const char *name, bool enable)
+{
+    struct cons_dev *cd;
+
+    for (cd = cons_devs; cd < cons_devs + ncons_devs; cd++) {
+        if (strcmp(cd->cd_name, name) != 0)
+            continue;
+        if (!cd->cd_present)
+            return -E_INVAL;
+        cd->cd_enabled = enable;
+        return 0;
+    }
+    return -E_INVAL;
 }
 
 /* Initialize the console devices. */
 void cons_init(void)
 {
-    cga_init();
+    struct cons_dev *cd;
+
+    for (cd = cons_devs; cd < cons_devs + ncons_devs; cd++)
+        cd->cd_enabled = cd->cd_present = cd->cd_probe();
     kbd_init();
-    serial_init();
+
+#ifdef JOS_DEBUGCON
+    /* The debug port, if there is one, is the only sink */
+    if (debugcon_exists) {
+        for (cd = cons_devs; cd < cons_devs + ncons_devs; cd++)
+            cd->cd_enabled = (cd->cd_write == debugcon_write);
+    } else
+        klog(KLOG_WARNING, KS_CONS, "Debug port does not exist!\n");
+#endif
 
     if (!serial_exists)
-        cprintf("Serial port does not exist!\n");
+        klog(KLOG_WARNING, KS_CONS, "Serial port does not exist!\n");
+}
+
+/* Move the console onto its final mappings, once mem_init has run. */
+void cons_mem_init(void)
+{
+    cga_mem_init();
 }
 
 
@@ -442,6 +817,8 @@ int getchar(void)
 {
     int c;
 
+    /* Get the prompt out before we sit and wait */
+    serial_flush();
     while ((c = cons_getc()) == 0)
         /* do nothing */;
     return c;
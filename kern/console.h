@@ -12,13 +12,41 @@
 #define MONO_BUF    0xB0000
 #define CGA_BASE    0x3D4
 #define CGA_BUF     0xB8000
+#define VGA_BUF     0xA0000     /* the whole VGA memory window */
+#define VGA_BUFSIZE 0x20000
 
 #define CRT_ROWS    25
 #define CRT_COLS    80
 #define CRT_SIZE    (CRT_ROWS * CRT_COLS)
+#define CRT_MEMSIZE 0x4000      /* characters of text memory at the buffer */
+
+/* A console output device. */
+struct cons_dev {
+    const char *cd_name;
+    bool (*cd_probe)(void);     /* set the device up; false if absent */
+    void (*cd_write)(const char *buf, size_t len);
+    bool cd_present;
+    bool cd_enabled;            /* toggled with cons_enable */
+    uint64_t cd_nbytes;         /* bytes written */
+    uint64_t cd_cycles;         /* TSC cycles spent in cd_write */
+};
+
+extern struct cons_dev cons_devs[];
+extern const int ncons_devs;
+
+/* The first panic message, or NULL; set in kern/init.c.  Once it is set,
+ * console output is written straight through to every device. */
+extern const char *panicstr;
 
 void cons_init(void);
+void cons_mem_init(void);
 int cons_getc(void);
+void cons_write(const char *buf, size_t len);
+int cons_enable(const char *name, bool enable);
+void serial_flush(void);
+int serial_set_baud(unsigned baud);
+unsigned serial_get_baud(void);
+size_t serial_bench(size_t nbytes, uint64_t *cycles);
 
 void kbd_intr(void);    /* irq 1 */
 void serial_intr(void); /* irq 4 */
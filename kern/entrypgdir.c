@@ -1,6 +1,45 @@
 #include <inc/mmu.h>
 #include <inc/memlayout.h>
 
+#ifdef JOS_PAE
+
+/*
+ * The PAE entry page directory maps the same 16MB at 0 and at KERNBASE,
+ * with 2MB pages instead of page tables (PTE_PS needs no CR4 bit under
+ * PAE).  That is more than the non-PAE 4MB, to leave boot_alloc room for the
+ * page metadata of a large memory (ENTRYMAPSIZE in kern/pmap.c).
+ * entry_pdpt, which entry.S loads into cr3, points at the four directories
+ * of entry_pgdir.  Page directory pointer table entries only take PTE_P (and
+ * the cache bits); everything else is reserved.
+ *
+ * The linker cannot put a link-time address into half of a 64-bit word, so
+ * entry_pdpt is spelled out as low and high 32-bit halves.
+ */
+#define ENTRY_PS(i)     ((i) * PTSIZE + PTE_P + PTE_W + PTE_PS)
+#define ENTRY_MAP(base)                                                 \
+    [(base) + 0] = ENTRY_PS(0), [(base) + 1] = ENTRY_PS(1),             \
+    [(base) + 2] = ENTRY_PS(2), [(base) + 3] = ENTRY_PS(3),             \
+    [(base) + 4] = ENTRY_PS(4), [(base) + 5] = ENTRY_PS(5),             \
+    [(base) + 6] = ENTRY_PS(6), [(base) + 7] = ENTRY_PS(7)
+
+__attribute__((__aligned__(PGSIZE)))
+pde_t entry_pgdir[NPDENTRIES] = {
+    /* Map VA's [0, 16MB) to PA's [0, 16MB). */
+    ENTRY_MAP(0),
+    /* Map VA's [KERNBASE, KERNBASE+16MB) to PA's [0, 16MB). */
+    ENTRY_MAP(KERNBASE>>PDXSHIFT)
+};
+
+__attribute__((__aligned__(32)))
+uint32_t entry_pdpt[2 * NPDPENTRIES] = {
+    ((uintptr_t)entry_pgdir - KERNBASE) + 0 * PGSIZE + PTE_P, 0,
+    ((uintptr_t)entry_pgdir - KERNBASE) + 1 * PGSIZE + PTE_P, 0,
+    ((uintptr_t)entry_pgdir - KERNBASE) + 2 * PGSIZE + PTE_P, 0,
+    ((uintptr_t)entry_pgdir - KERNBASE) + 3 * PGSIZE + PTE_P, 0
+};
+
+#else
+
 pte_t entry_pgtable[NPTENTRIES];
 
 /*
@@ -1059,3 +1098,4 @@ pte_t entry_pgtable[NPTENTRIES] = {
     0x3ff000 | PTE_P | PTE_W,
 };
 
+#endif /* !JOS_PAE */
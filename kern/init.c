@@ -8,6 +8,9 @@
 #include <kern/console.h>
 #include <kern/pmap.h>
 #include <kern/kclock.h>
+#include <kern/ksm.h>
+#include <kern/vmalloc.h>
+#include <kern/klog.h>
 
 
 void i386_init(void)
@@ -22,9 +25,13 @@ void i386_init(void)
     /* Initialize the console.
      * Can't call cprintf until after we do this! */
     cons_init();
+    klog_init();
 
     /* Lab 1 memory management initialization functions */
     mem_init();
+    cons_mem_init();
+    vmalloc_init();
+    ksm_init();
 
     /* Drop into the kernel monitor. */
     while (1)
@@ -54,10 +61,11 @@ void _panic(const char *file, int line, const char *fmt,...)
     __asm __volatile("cli; cld");
 
     va_start(ap, fmt);
-    cprintf("kernel panic at %s:%d: ", file, line);
+    cprintf(KERN_EMERG "kernel panic at %s:%d: ", file, line);
     vcprintf(fmt, ap);
     cprintf("\n");
     va_end(ap);
+    serial_flush();
 
 dead:
     /* break into the kernel monitor */
@@ -71,7 +79,7 @@ void _warn(const char *file, int line, const char *fmt,...)
     va_list ap;
 
     va_start(ap, fmt);
-    cprintf("kernel warning at %s:%d: ", file, line);
+    cprintf(KERN_WARNING "kernel warning at %s:%d: ", file, line);
     vcprintf(fmt, ap);
     cprintf("\n");
     va_end(ap);
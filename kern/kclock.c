@@ -1,11 +1,18 @@
 /* See COPYRIGHT for copyright information. */
 
-/* Support for reading the NVRAM from the real-time clock. */
+/* Support for reading the NVRAM from the real-time clock, and for timing
+ * the TSC against the PIT. */
 
 #include <inc/x86.h>
+#include <inc/stdio.h>
 
 #include <kern/kclock.h>
 
+/* Give up on the PIT after this many TSC cycles (a second at 2GHz, far
+ * more than 10ms on anything this runs on), and assume this rate. */
+#define TSC_CALIBRATE_LIMIT     (2000ULL * 1000 * 1000)
+#define TSC_FREQ_FALLBACK       (2000ULL * 1000 * 1000)
+
 
 unsigned mc146818_read(unsigned reg)
 {
@@ -18,3 +25,40 @@ void mc146818_write(unsigned reg, unsigned datum)
     outb(IO_RTC, reg);
     outb(IO_RTC+1, datum);
 }
+
+/* Return the TSC rate in Hz.  Measured once, by counting TSC ticks while
+ * PIT channel 2 counts down 10ms in one-shot mode.  If the channel never
+ * reaches its terminal count, or claims to have reached it at once (no PIT,
+ * or no port 0x61), TSC_FREQ_FALLBACK is used instead. */
+uint64_t tsc_freq(void)
+{
+    static uint64_t freq;
+    uint32_t count = TIMER_FREQ / 100;
+    uint64_t start, now;
+    uint8_t portb;
+
+    if (freq)
+        return freq;
+
+    /* Gate channel 2 on with the speaker off, then load mode 0 */
+    portb = inb(IO_PORTB);
+    outb(IO_PORTB, (portb & ~0x02) | 0x01);
+    outb(IO_TIMER+3, 0xB0);     /* channel 2, lobyte/hibyte, mode 0 */
+    outb(IO_TIMER+2, count & 0xFF);
+    outb(IO_TIMER+2, count >> 8);
+
+    /* Wait for the terminal count, but not forever */
+    start = read_tsc();
+    do
+        now = read_tsc();
+    while (!(inb(IO_PORTB) & 0x20) && now - start < TSC_CALIBRATE_LIMIT);
+    outb(IO_PORTB, portb);
+
+    if (now == start || now - start >= TSC_CALIBRATE_LIMIT) {
+        freq = TSC_FREQ_FALLBACK;
+        cprintf("tsc_freq: PIT channel 2 did not count down, "
+                "assuming %u MHz\n", (uint32_t) (freq / 1000000));
+    } else
+        freq = (now - start) * 100;
+    return freq;
+}
@@ -6,7 +6,13 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
 #define IO_RTC          0x070       /* RTC port */
+#define IO_TIMER        0x040       /* 8253 timer (PIT) ports */
+#define IO_PORTB        0x061       /* PIT channel 2 gate and output */
+
+#define TIMER_FREQ      1193182     /* PIT input clock, Hz */
 
 #define MC_NVRAM_START  0xe /* start of NVRAM: offset 14 */
 #define MC_NVRAM_SIZE   50  /* 50 bytes of NVRAM */
@@ -26,7 +32,17 @@
 /* NVRAM byte 36: current century.  (please increment in Dec99!) */
 #define NVRAM_CENTURY   (MC_NVRAM_START + 36)   /* RTC offset 0x32 */
 
+/* NVRAM bytes 38 and 39: memory above 16MB, in 64KB units */
+#define NVRAM_EXT16LO   (MC_NVRAM_START + 38)   /* low byte; RTC off. 0x34 */
+#define NVRAM_EXT16HI   (MC_NVRAM_START + 39)   /* high byte; RTC off. 0x35 */
+
+/* NVRAM bytes 77-79: memory above 4GB, in 64KB units (QEMU and SeaBIOS) */
+#define NVRAM_HIMEM0    (MC_NVRAM_START + 77)   /* low byte; RTC off. 0x5b */
+#define NVRAM_HIMEM1    (MC_NVRAM_START + 78)   /* RTC off. 0x5c */
+#define NVRAM_HIMEM2    (MC_NVRAM_START + 79)   /* high byte; RTC off. 0x5d */
+
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
+uint64_t tsc_freq(void);
 
 #endif /* !JOS_KERN_KCLOCK_H */
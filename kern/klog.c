@@ -0,0 +1,385 @@
+/* See COPYRIGHT for copyright information. */
+
+/*
+ * In-memory kernel log.  Everything cprintf prints is also appended, a line
+ * at a time, to a ring of records, each stamped with the TSC and a severity
+ * level.  Once the ring fills, the oldest lines are overwritten.
+ *
+ * Only lines at or below klog_console_level are passed on to the console
+ * devices, so chatty output can be kept off a slow console and read back
+ * later with the monitor's dmesg command.
+ *
+ * klog() adds per-subsystem thresholds and per-call-site rate limits in
+ * front of all that, both checked before anything is formatted.
+ */
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/klog.h>
+#include <kern/console.h>
+#include <kern/kclock.h>
+
+struct klog_hdr {
+    uint64_t kh_tsc;        /* when the line was started */
+    uint16_t kh_len;        /* bytes of text that follow, no newline */
+    uint8_t kh_level;
+};
+
+/* The ring.  Offsets are free-running; index with % KLOG_BUFSIZE. */
+static char klog_buf[KLOG_BUFSIZE];
+static uint32_t klog_head;      /* where the next record goes */
+static uint32_t klog_tail;      /* oldest record */
+static uint32_t klog_nlost;     /* lines overwritten so far */
+
+/* The line being built up, not yet in the ring. */
+static char klog_line[KLOG_LINEMAX];
+static uint16_t klog_linelen;
+static uint8_t klog_linelevel;
+static uint64_t klog_linetsc;
+static bool klog_linestarted;
+
+int klog_console_level = KLOG_DEBUG;
+
+const char *const klog_subsys_names[NKS] = {
+    [KS_KERN] = "kern",
+    [KS_MEM] = "mem",
+    [KS_VM] = "vm",
+    [KS_KSM] = "ksm",
+    [KS_CONS] = "cons",
+};
+int klog_subsys_level[NKS] = { [0 ... NKS - 1] = KLOG_INFO };
+uint32_t klog_subsys_nsuppressed[NKS];
+
+/* TSC cycles to earn one rate-limit token, and to refill a whole bucket;
+ * 0 until klog_init. */
+static uint64_t klog_rl_interval;
+static uint64_t klog_rl_fill;
+
+static void check_klog(void);
+
+/* Work out the rate-limit refill times.  This calibrates the TSC, if
+ * nothing has yet, so it is done once here rather than in whichever klog()
+ * happens to come first. */
+void klog_init(void)
+{
+    klog_rl_interval = tsc_freq() / KLOG_RL_RATE;
+    klog_rl_fill = klog_rl_interval * KLOG_RL_BURST;
+    check_klog();
+}
+
+static void klog_copyin(uint32_t off, const void *src, size_t len)
+{
+    size_t n = MIN(len, KLOG_BUFSIZE - off % KLOG_BUFSIZE);
+
+    memmove(klog_buf + off % KLOG_BUFSIZE, src, n);
+    memmove(klog_buf, (const char *) src + n, len - n);
+}
+
+static void klog_copyout(void *dst, uint32_t off, size_t len)
+{
+    size_t n = MIN(len, KLOG_BUFSIZE - off % KLOG_BUFSIZE);
+
+    memmove(dst, klog_buf + off % KLOG_BUFSIZE, n);
+    memmove((char *) dst + n, klog_buf, len - n);
+}
+
+/* Move the current line into the ring, dropping the oldest lines to make
+ * room.  Called with interrupts off. */
+static void klog_commit(void)
+{
+    struct klog_hdr h, old;
+    size_t need = sizeof(h) + klog_linelen;
+
+    while (klog_head - klog_tail + need > KLOG_BUFSIZE) {
+        klog_copyout(&old, klog_tail, sizeof(old));
+        klog_tail += sizeof(old) + old.kh_len;
+        klog_nlost++;
+    }
+
+    h.kh_tsc = klog_linetsc;
+    h.kh_len = klog_linelen;
+    h.kh_level = klog_linelevel;
+    klog_copyin(klog_head, &h, sizeof(h));
+    klog_copyin(klog_head + sizeof(h), klog_line, klog_linelen);
+    klog_head += need;
+
+    klog_linelen = 0;
+    klog_linestarted = false;
+}
+
+/* If *fmt starts with a KERN_* level prefix, skip past it and return the
+ * level.  Otherwise return -1. */
+int klog_level(const char **fmt)
+{
+    const char *s = *fmt;
+
+    if (s[0] != '<' || s[1] < '0' || s[1] >= '0' + NKLOG_LEVELS ||
+        s[2] != '>')
+        return -1;
+    *fmt = s + 3;
+    return s[1] - '0';
+}
+
+/* Log 'len' bytes of output and show them on the console if their line's
+ * level allows.  'level' is the level for any lines this output starts, or
+ * -1 for KLOG_DEFAULT; text that continues a line keeps that line's level. */
+void klog_write(int level, const char *buf, size_t len)
+{
+    uint32_t eflags;
+    size_t i, n, j;
+    int linelevel;
+
+    for (i = 0; i < len; i += n) {
+        /* Take up to and including the next newline */
+        for (n = 0; i + n < len; )
+            if (buf[i + n++] == '\n')
+                break;
+
+        eflags = irq_save();
+        if (!klog_linestarted) {
+            klog_linestarted = true;
+            klog_linetsc = read_tsc();
+            klog_linelevel = level >= 0 ? level : KLOG_DEFAULT;
+        }
+        linelevel = klog_linelevel;
+        for (j = i; j < i + n; j++) {
+            if (buf[j] == '\n') {
+                klog_commit();
+                continue;
+            }
+            if (klog_linelen == KLOG_LINEMAX) {
+                klog_commit();
+                klog_linestarted = true;
+            }
+            klog_line[klog_linelen++] = buf[j];
+        }
+        irq_restore(eflags);
+
+        if (linelevel <= klog_console_level || panicstr)
+            cons_write(buf + i, n);
+    }
+}
+
+static bool klog_match(const char *s, const char *match)
+{
+    size_t n = strlen(match);
+
+    for (; *s; s++)
+        if (strncmp(s, match, n) == 0)
+            return true;
+    return false;
+}
+
+/* Print the logged lines at or below 'maxlevel' that contain 'match' (all
+ * of them if it is NULL).  Output goes straight to the console so that it
+ * does not feed back into the log. */
+void klog_dump(int maxlevel, const char *match)
+{
+    char text[KLOG_LINEMAX + 1];
+    char out[KLOG_LINEMAX + 32];
+    struct klog_hdr h;
+    uint64_t freq = tsc_freq();
+    uint32_t off;
+    int n;
+
+    if (klog_nlost) {
+        n = snprintf(out, sizeof(out), "(%u older lines overwritten)\n",
+                     klog_nlost);
+        cons_write(out, n);
+    }
+
+    for (off = klog_tail; off != klog_head; off += sizeof(h) + h.kh_len) {
+        klog_copyout(&h, off, sizeof(h));
+        if (h.kh_level > maxlevel)
+            continue;
+        klog_copyout(text, off + sizeof(h), h.kh_len);
+        text[h.kh_len] = '\0';
+        if (match && !klog_match(text, match))
+            continue;
+        n = snprintf(out, sizeof(out), "[%5u.%06u] <%d> %s\n",
+                     (uint32_t) (h.kh_tsc / freq),
+                     (uint32_t) (h.kh_tsc % freq * 1000000 / freq),
+                     h.kh_level, text);
+        cons_write(out, MIN(n, (int) sizeof(out) - 1));
+    }
+}
+
+
+/* Take a token from the call site's bucket, refilling it for the time that
+ * has passed.  Returns false, and counts the message as suppressed, if
+ * there is none left.  Everything gets through before klog_init. */
+bool klog_ratelimit(struct klog_ratelimit *rl, int subsys)
+{
+    uint64_t now = read_tsc();
+
+    if (!klog_rl_interval)
+        return true;
+    if (!rl->rl_last || rl->rl_tokens == KLOG_RL_BURST ||
+        now - rl->rl_last >= klog_rl_fill) {
+        rl->rl_tokens = KLOG_RL_BURST;
+        rl->rl_last = now;
+    } else
+        /* at most KLOG_RL_BURST rounds, and usually none */
+        while (rl->rl_tokens < KLOG_RL_BURST &&
+               now - rl->rl_last >= klog_rl_interval) {
+            rl->rl_tokens++;
+            rl->rl_last += klog_rl_interval;
+        }
+
+    if (rl->rl_tokens) {
+        rl->rl_tokens--;
+        return true;
+    }
+    rl->rl_nsuppressed++;
+    klog_subsys_nsuppressed[subsys]++;
+    return false;
+}
+
+static void klog_prefix(int level, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vcprintf_level(level, fmt, ap);
+    va_end(ap);
+}
+
+/* The formatting half of klog(), once the message has been let through. */
+void klog_printf(struct klog_ratelimit *rl, int level, int subsys,
+                 const char *fmt, ...)
+{
+    va_list ap;
+
+    if (rl->rl_nsuppressed) {
+        klog_prefix(level, "%s: %u messages suppressed\n",
+                    klog_subsys_names[subsys], rl->rl_nsuppressed);
+        rl->rl_nsuppressed = 0;
+    }
+
+    klog_prefix(level, "%s: ", klog_subsys_names[subsys]);
+    va_start(ap, fmt);
+    vcprintf_level(level, fmt, ap);
+    va_end(ap);
+}
+
+/* Set the klog() threshold of the named subsystem. */
+int klog_set_level(const char *subsys, int level)
+{
+    int i;
+
+    if (level < 0 || level >= NKLOG_LEVELS)
+        return -E_INVAL;
+    for (i = 0; i < NKS; i++)
+        if (strcmp(klog_subsys_names[i], subsys) == 0) {
+            klog_subsys_level[i] = level;
+            return 0;
+        }
+    return -E_INVAL;
+}
+
+
+/*
+ * Check that the ring drops its oldest lines once it wraps, counting them,
+ * and that overlong lines are split.  This runs on the live ring, so what
+ * has been logged so far is put aside first (all but the newest
+ * KLOG_CHECK_SAVE bytes of it are counted as lost) and put back afterwards.
+ */
+#define KLOG_CHECK_SAVE 2048
+#define KLOG_CHECK_LINE 100
+
+static void check_klog(void)
+{
+    char save[KLOG_CHECK_SAVE], saveline[KLOG_LINEMAX];
+    char line[KLOG_LINEMAX + 16], expect[16];
+    uint32_t nsave, nlost, start, off, nrec;
+    uint16_t savelinelen = klog_linelen;
+    uint8_t savelinelevel = klog_linelevel;
+    uint64_t savelinetsc = klog_linetsc;
+    bool savelinestarted = klog_linestarted;
+    int console_level = klog_console_level;
+    int i, n, nlines;
+    struct klog_hdr h;
+
+    /* put the log aside */
+    while (klog_head - klog_tail > sizeof(save)) {
+        klog_copyout(&h, klog_tail, sizeof(h));
+        klog_tail += sizeof(h) + h.kh_len;
+        klog_nlost++;
+    }
+    nsave = klog_head - klog_tail;
+    klog_copyout(save, klog_tail, nsave);
+    nlost = klog_nlost;
+    memmove(saveline, klog_line, klog_linelen);
+
+    /* start near the top so the free-running offsets wrap too, and keep
+     * the test lines off the console */
+    start = klog_head = klog_tail = -(uint32_t) (KLOG_BUFSIZE / 2);
+    klog_nlost = 0;
+    klog_linelen = 0;
+    klog_linestarted = false;
+    klog_console_level = -1;
+
+    /* a line KLOG_LINEMAX + 10 long is split in two */
+    memset(line, 'x', KLOG_LINEMAX + 10);
+    line[KLOG_LINEMAX + 10] = '\n';
+    klog_write(KLOG_DEBUG, line, KLOG_LINEMAX + 11);
+    off = klog_tail;
+    klog_copyout(&h, off, sizeof(h));
+    assert(h.kh_len == KLOG_LINEMAX && h.kh_level == KLOG_DEBUG);
+    off += sizeof(h) + h.kh_len;
+    klog_copyout(&h, off, sizeof(h));
+    assert(h.kh_len == 10 && h.kh_level == KLOG_DEBUG);
+    assert(off + sizeof(h) + h.kh_len == klog_head);
+
+    /* one exactly KLOG_LINEMAX long is not */
+    off = klog_head;
+    klog_write(KLOG_DEBUG, line + 10, KLOG_LINEMAX + 1);
+    klog_copyout(&h, off, sizeof(h));
+    assert(h.kh_len == KLOG_LINEMAX);
+    assert(off + sizeof(h) + h.kh_len == klog_head);
+
+    /* write twice the ring's worth of numbered lines */
+    nlines = 2 * KLOG_BUFSIZE / (sizeof(h) + KLOG_CHECK_LINE) + 1;
+    for (i = 0; i < nlines; i++) {
+        n = snprintf(line, sizeof(line), "%08d", i);
+        memset(line + n, '.', KLOG_CHECK_LINE - n);
+        line[KLOG_CHECK_LINE] = '\n';
+        klog_write(KLOG_DEBUG, line, KLOG_CHECK_LINE + 1);
+    }
+    assert(klog_head - start > 2 * KLOG_BUFSIZE);
+    assert(klog_head - klog_tail <= KLOG_BUFSIZE);
+    assert(klog_head - klog_tail >
+           KLOG_BUFSIZE - sizeof(h) - KLOG_CHECK_LINE);
+
+    /* what is left is the newest lines, in order, and every line that is
+     * gone was counted */
+    for (off = klog_tail, nrec = 0; off != klog_head;
+         off += sizeof(h) + h.kh_len, nrec++) {
+        klog_copyout(&h, off, sizeof(h));
+        assert(h.kh_len == KLOG_CHECK_LINE);
+        klog_copyout(line, off + sizeof(h), 8);
+        snprintf(expect, sizeof(expect), "%08d",
+                 nlines - (int) ((klog_head - off) /
+                                 (sizeof(h) + KLOG_CHECK_LINE)));
+        assert(memcmp(line, expect, 8) == 0);
+    }
+    assert(nrec + klog_nlost == 3 + nlines);
+
+    /* put the log back */
+    klog_head = klog_tail = 0;
+    klog_copyin(0, save, nsave);
+    klog_head = nsave;
+    klog_nlost = nlost;
+    memmove(klog_line, saveline, savelinelen);
+    klog_linelen = savelinelen;
+    klog_linelevel = savelinelevel;
+    klog_linetsc = savelinetsc;
+    klog_linestarted = savelinestarted;
+    klog_console_level = console_level;
+
+    cprintf("check_klog() succeeded!\n");
+}
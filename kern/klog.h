@@ -0,0 +1,92 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KLOG_H
+#define JOS_KERN_KLOG_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/stdarg.h>
+
+/* Severity levels, most severe first. */
+enum {
+    KLOG_EMERG = 0,
+    KLOG_ALERT,
+    KLOG_CRIT,
+    KLOG_ERR,
+    KLOG_WARNING,
+    KLOG_NOTICE,
+    KLOG_INFO,
+    KLOG_DEBUG,
+    NKLOG_LEVELS
+};
+
+/* A cprintf format may begin with one of these to set the level of the
+ * lines it starts.  Lines without one are logged at KLOG_DEFAULT. */
+#define KERN_EMERG      "<0>"
+#define KERN_ALERT      "<1>"
+#define KERN_CRIT       "<2>"
+#define KERN_ERR        "<3>"
+#define KERN_WARNING    "<4>"
+#define KERN_NOTICE     "<5>"
+#define KERN_INFO       "<6>"
+#define KERN_DEBUG      "<7>"
+
+#define KLOG_DEFAULT    KLOG_INFO
+
+#define KLOG_BUFSIZE    (64 * 1024)     /* power of 2 */
+#define KLOG_LINEMAX    160             /* longer lines are split */
+
+/* Lines above this level only go to the log, not to the console. */
+extern int klog_console_level;
+
+/* Subsystems, each with its own threshold for klog(). */
+enum {
+    KS_KERN = 0,
+    KS_MEM,
+    KS_VM,
+    KS_KSM,
+    KS_CONS,
+    NKS
+};
+
+extern const char *const klog_subsys_names[NKS];
+extern int klog_subsys_level[NKS];          /* klog() drops levels above */
+extern uint32_t klog_subsys_nsuppressed[NKS];
+
+/* Token bucket for one klog() call site: KLOG_RL_BURST messages may go
+ * through back to back, and KLOG_RL_RATE a second after that. */
+#define KLOG_RL_BURST   10
+#define KLOG_RL_RATE    5
+
+struct klog_ratelimit {
+    uint64_t rl_last;           /* TSC of the last refill; 0 until used */
+    uint32_t rl_tokens;
+    uint32_t rl_nsuppressed;    /* dropped since a message last got out */
+};
+
+/*
+ * Log a message for 'subsys' at 'level', prefixed with the subsystem name.
+ * A message above the subsystem's threshold, or from a call site that has
+ * run out of tokens, is dropped before any of its arguments are formatted.
+ */
+#define klog(level, subsys, fmt, ...) do {                              \
+    static struct klog_ratelimit klog_rl_;                              \
+    if ((level) <= klog_subsys_level[subsys] &&                         \
+        klog_ratelimit(&klog_rl_, (subsys)))                            \
+        klog_printf(&klog_rl_, (level), (subsys), fmt, ##__VA_ARGS__);  \
+} while (0)
+
+void klog_init(void);
+int klog_level(const char **fmt);
+void klog_write(int level, const char *buf, size_t len);
+void klog_dump(int maxlevel, const char *match);
+bool klog_ratelimit(struct klog_ratelimit *rl, int subsys);
+void klog_printf(struct klog_ratelimit *rl, int level, int subsys,
+                 const char *fmt, ...);
+int klog_set_level(const char *subsys, int level);
+
+int vcprintf_level(int level, const char *fmt, va_list ap);
+
+#endif /* !JOS_KERN_KLOG_H */
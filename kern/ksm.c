@@ -0,0 +1,292 @@
+/* See COPYRIGHT for copyright information. */
+
+/*
+ * Same-page merging.  Ranges of virtual memory registered as mergeable are
+ * scanned for pages with identical contents; duplicates are replaced by
+ * copy-on-write mappings of a single shared frame, and page_fault_resolve()
+ * breaks the sharing again when somebody writes.
+ *
+ * Like Linux's KSM, a scan keeps two kinds of entries in its hash table:
+ * "stable" frames that are already shared (write-protected everywhere, with
+ * an extra reference held by ksm_stable[]) and "candidate" pages seen once
+ * during this scan, which are left writable until a second page with the
+ * same contents turns up.
+ */
+
+#include <inc/x86.h>
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/pmap.h>
+#include <kern/ksm.h>
+
+static struct ksm_range {
+    pde_t *pgdir;
+    uintptr_t va;
+    size_t len;
+} ksm_ranges[KSM_NRANGES];
+
+static struct ksm_slot {
+    uint32_t hash;
+    struct page_info *pp;   /* stable frame, or NULL for a candidate */
+    pde_t *pgdir;           /* where a candidate is mapped */
+    uintptr_t va;
+} ksm_slots[KSM_NSLOTS];
+
+static struct page_info *ksm_stable[KSM_NSTABLE];
+static int ksm_nstable;
+
+static void check_ksm(void);
+
+void ksm_init(void)
+{
+    check_ksm();
+}
+
+/*
+ * Tag [va, va+len) in pgdir as mergeable.  va and len must be page-aligned.
+ * Returns 0 on success, -E_NO_MEM if the range table is full.
+ */
+int ksm_register(pde_t *pgdir, void *va, size_t len)
+{
+    int i;
+
+    for (i = 0; i < KSM_NRANGES; i++) {
+        if (ksm_ranges[i].len)
+            continue;
+        ksm_ranges[i].pgdir = pgdir;
+        ksm_ranges[i].va = (uintptr_t) va;
+        ksm_ranges[i].len = len;
+        return 0;
+    }
+    return -E_NO_MEM;
+}
+
+/* Forget a range previously passed to ksm_register. */
+void ksm_unregister(pde_t *pgdir, void *va, size_t len)
+{
+    int i;
+
+    for (i = 0; i < KSM_NRANGES; i++)
+        if (ksm_ranges[i].pgdir == pgdir &&
+            ksm_ranges[i].va == (uintptr_t) va && ksm_ranges[i].len == len)
+            ksm_ranges[i].len = 0;
+}
+
+/* FNV-1a over the words of a page. */
+static uint32_t ksm_hash(struct page_info *pp)
+{
+    uint32_t *w = kmap(pp);
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i = 0; i < PGSIZE / 4; i++)
+        h = (h ^ w[i]) * 16777619;
+    kunmap(w);
+    return h;
+}
+
+static bool ksm_same(struct page_info *a, struct page_info *b)
+{
+    void *ka = kmap(a), *kb = kmap(b);
+    bool same = memcmp(ka, kb, PGSIZE) == 0;
+
+    kunmap(kb);
+    kunmap(ka);
+    return same;
+}
+
+/* Find the slot for 'hash' whose page has the same contents as 'pp', or the
+ * empty slot where such a page should go.  NULL if the table is full. */
+static struct ksm_slot *ksm_probe(uint32_t hash, struct page_info *pp)
+{
+    struct ksm_slot *slot;
+    struct page_info *cpp;
+    int i, n;
+
+    for (n = 0, i = hash % KSM_NSLOTS; n < KSM_NSLOTS;
+         n++, i = (i + 1) % KSM_NSLOTS) {
+        slot = &ksm_slots[i];
+        if (!slot->pgdir && !slot->pp)
+            return slot;
+        if (slot->hash != hash)
+            continue;
+        cpp = slot->pp ? slot->pp
+                       : page_lookup(slot->pgdir, (void *) slot->va, NULL);
+        if (cpp && (cpp == pp || ksm_same(cpp, pp)))
+            return slot;
+    }
+    return NULL;
+}
+
+/* Permissions for a read-only shared mapping replacing the one in 'pte'. */
+static int ksm_perm(pte_t pte)
+{
+    int perm = PGOFF(pte) & ~(PTE_A | PTE_D | PTE_P);
+
+    if (perm & (PTE_W | PTE_COW))
+        perm = (perm & ~PTE_W) | PTE_COW;
+    return perm;
+}
+
+/* Turn the candidate in 'slot' into a stable shared frame.  A candidate
+ * that has picked up other references since it was seen is left alone. */
+static struct page_info *ksm_promote(struct ksm_slot *slot)
+{
+    struct page_info *pp;
+    pte_t *pte;
+
+    if (ksm_nstable == KSM_NSTABLE)
+        return NULL;
+    if (!(pp = page_lookup(slot->pgdir, (void *) slot->va, &pte)) ||
+        pp->pp_ref != 1)
+        return NULL;
+    *pte = page2pa(pp) | ksm_perm(*pte) | PTE_P;
+    tlb_invalidate(slot->pgdir, (void *) slot->va);
+
+    /* our reference is not a PTE, so compaction must leave it alone */
+    page_pin(pp);
+    pp->pp_ref++;
+    ksm_stable[ksm_nstable++] = pp;
+    slot->pp = pp;
+    return pp;
+}
+
+/* Consider the page mapped at va in pgdir for merging.  Returns 1 if it was
+ * merged into a shared frame.  Only pages mapped here and nowhere else are
+ * merged: one with other references (another mapping, or one the kernel
+ * holds) would stay allocated anyway, and its other users would not see it
+ * turn read-only. */
+static int ksm_scan_page(pde_t *pgdir, uintptr_t va)
+{
+    struct page_info *pp, *spp;
+    struct ksm_slot *slot;
+    uint32_t hash;
+    pte_t *pte;
+
+    if (!(pp = page_lookup(pgdir, (void *) va, &pte)) || pp->pp_ref != 1)
+        return 0;
+    hash = ksm_hash(pp);
+    if (!(slot = ksm_probe(hash, pp)))
+        return 0;
+
+    if (!slot->pgdir && !slot->pp) {
+        /* first of its kind: remember it as a candidate */
+        slot->hash = hash;
+        slot->pgdir = pgdir;
+        slot->va = va;
+        return 0;
+    }
+
+    if (!(spp = slot->pp) && !(spp = ksm_promote(slot)))
+        return 0;
+    if (spp == pp)
+        return 0;
+    if (page_insert(pgdir, spp, (void *) va, ksm_perm(*pte)) < 0)
+        return 0;
+    return 1;
+}
+
+/*
+ * Run one pass over every registered range, merging pages with identical
+ * contents.  Returns the number of pages merged by this pass, and updates
+ * the pages-saved count in page_stats.
+ */
+int ksm_scan(void)
+{
+    struct ksm_slot *slot;
+    struct page_info *pp;
+    uint32_t hash, nsaved = 0;
+    size_t off;
+    int i, j, nmerged = 0;
+
+    memset(ksm_slots, 0, sizeof(ksm_slots));
+
+    /* Re-seed the table with the frames that are still shared, and let go
+     * of those only we hold on to (or that duplicate another frame). */
+    for (i = j = 0; i < ksm_nstable; i++) {
+        pp = ksm_stable[i];
+        hash = ksm_hash(pp);
+        if (pp->pp_ref > 1 && (slot = ksm_probe(hash, pp)) && !slot->pp) {
+            slot->hash = hash;
+            slot->pp = pp;
+            ksm_stable[j++] = pp;
+        } else
+            page_decref(pp);
+    }
+    ksm_nstable = j;
+
+    for (i = 0; i < KSM_NRANGES; i++)
+        for (off = 0; off < ksm_ranges[i].len; off += PGSIZE)
+            nmerged += ksm_scan_page(ksm_ranges[i].pgdir,
+                                     ksm_ranges[i].va + off);
+
+    /* every mapping of a shared frame beyond the first is a page saved */
+    for (i = 0; i < ksm_nstable; i++)
+        if (ksm_stable[i]->pp_ref > 2)
+            nsaved += ksm_stable[i]->pp_ref - 2;
+    page_stats->ps_nmerged = nsaved;
+
+    return nmerged;
+}
+
+
+/*
+ * Check merging of identical pages and copy-on-break.
+ */
+static void check_ksm(void)
+{
+    struct page_info *pp0, *pp1, *pp2, *pp3, *pp;
+    char *va = (char *) PTSIZE;
+    pte_t *pte;
+
+    assert((pp0 = page_alloc(ALLOC_ZERO)));
+    assert((pp1 = page_alloc(ALLOC_ZERO)));
+    assert((pp2 = page_alloc(ALLOC_ZERO)));
+    assert((pp3 = page_alloc(ALLOC_ZERO)));
+    memset(page2kva(pp2), 1, PGSIZE);
+    assert(page_insert(kern_pgdir, pp0, va, PTE_W) == 0);
+    assert(page_insert(kern_pgdir, pp1, va + PGSIZE, PTE_W) == 0);
+    assert(page_insert(kern_pgdir, pp2, va + 2 * PGSIZE, PTE_W) == 0);
+    assert(page_insert(kern_pgdir, pp3, va + 3 * PGSIZE, PTE_W) == 0);
+    assert(page_insert(kern_pgdir, pp3, va + 4 * PGSIZE, PTE_W) == 0);
+    assert(ksm_register(kern_pgdir, va, 4 * PGSIZE) == 0);
+
+    /* the two zero pages merge, the other one stays, and so does the zero
+     * page that is also mapped outside the range */
+    assert(ksm_scan() == 1);
+    assert(page_lookup(kern_pgdir, va, &pte) == pp0);
+    assert((*pte & (PTE_W | PTE_COW)) == PTE_COW);
+    assert(page_lookup(kern_pgdir, va + PGSIZE, NULL) == pp0);
+    assert(page_lookup(kern_pgdir, va + 2 * PGSIZE, &pte) == pp2);
+    assert(*pte & PTE_W);
+    assert(page_lookup(kern_pgdir, va + 3 * PGSIZE, &pte) == pp3);
+    assert(*pte & PTE_W);
+    assert(pp3->pp_ref == 2);
+    assert(pp0->pp_ref == 3);
+    assert(page_stats->ps_nmerged == 1);
+
+    /* a second pass finds nothing new */
+    assert(ksm_scan() == 0);
+    assert(page_stats->ps_nmerged == 1);
+
+    /* writing breaks the sharing again */
+    assert(page_fault_resolve(kern_pgdir, va + PGSIZE, FEC_PR | FEC_WR) == 0);
+    assert((pp = page_lookup(kern_pgdir, va + PGSIZE, NULL)) && pp != pp0);
+    va[PGSIZE] = 1;
+    assert(va[0] == 0);
+    assert(ksm_scan() == 0);
+    assert(page_stats->ps_nmerged == 0);
+
+    /* tear down; the next scan drops the last shared-frame reference */
+    ksm_unregister(kern_pgdir, va, 4 * PGSIZE);
+    page_remove_range(kern_pgdir, va, 5 * PGSIZE);
+    assert(pp0->pp_ref == 1);
+    ksm_scan();
+    assert(ksm_nstable == 0 && pp0->pp_ref == 0);
+
+    pgdir_free_pt(kern_pgdir, va);
+
+    cprintf("check_ksm() succeeded!\n");
+}
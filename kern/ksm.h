@@ -0,0 +1,20 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KSM_H
+#define JOS_KERN_KSM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/memlayout.h>
+
+#define KSM_NRANGES     16      /* mergeable ranges that can be registered */
+#define KSM_NSLOTS      1024    /* pages one scan can remember */
+#define KSM_NSTABLE     256     /* shared frames kept across scans */
+
+void ksm_init(void);
+int ksm_register(pde_t *pgdir, void *va, size_t len);
+void ksm_unregister(pde_t *pgdir, void *va, size_t len);
+int ksm_scan(void);
+
+#endif /* !JOS_KERN_KSM_H */
@@ -0,0 +1,43 @@
+/* See COPYRIGHT for copyright information. */
+
+/* Storage for the ktrace rings, and formatting them for the console. */
+
+#include <inc/stdio.h>
+
+#include <kern/ktrace.h>
+#include <kern/console.h>
+
+struct ktrace_buf ktrace_bufs[NCPU];
+bool ktrace_enabled = true;
+
+/* Print the last 'nents' events of each CPU's ring, oldest first, with
+ * times in cycles since the first event shown.  Output goes straight to
+ * the console, not through the kernel log. */
+void ktrace_dump(int nents)
+{
+    char out[160];
+    struct ktrace_buf *kb;
+    struct ktrace_ent *ke;
+    uint64_t t0;
+    uint32_t i, head;
+    int cpu, n;
+
+    for (cpu = 0; cpu < NCPU; cpu++) {
+        kb = &ktrace_bufs[cpu];
+        if (!(head = kb->kb_head))
+            continue;
+        i = head - MIN(head, MIN((uint32_t) nents, KTRACE_NENTS));
+        t0 = kb->kb_ents[i % KTRACE_NENTS].ke_tsc;
+        for (; i != head; i++) {
+            ke = &kb->kb_ents[i % KTRACE_NENTS];
+            n = snprintf(out, sizeof(out), "cpu%d %10llu  ", cpu,
+                         ke->ke_tsc - t0);
+            n += snprintf(out + n, sizeof(out) - n - 1, ke->ke_fmt,
+                          ke->ke_args[0], ke->ke_args[1], ke->ke_args[2],
+                          ke->ke_args[3], ke->ke_args[4], ke->ke_args[5]);
+            n = MIN(n, (int) sizeof(out) - 2);
+            out[n++] = '\n';
+            cons_write(out, n);
+        }
+    }
+}
@@ -0,0 +1,72 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KTRACE_H
+#define JOS_KERN_KTRACE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/x86.h>
+#include <inc/memlayout.h>
+
+#include <kern/pmap.h>
+
+/*
+ * Binary event trace.  ktrace(fmt, ...) stores the format pointer, the TSC
+ * and up to KTRACE_NARGS 32-bit arguments in this CPU's ring, and leaves the
+ * formatting to whoever reads the ring: the tracedump monitor command, or
+ * ktrace-decode.py on the host.  So the format, and any %s argument, must
+ * be a string that is still around then, such as a literal.
+ *
+ * ktrace-decode.py knows the layout of these structures; keep it in step.
+ */
+
+#define KTRACE_NARGS    6
+#define KTRACE_NENTS    512     /* per CPU, power of 2 */
+
+struct ktrace_ent {
+    uint64_t ke_tsc;
+    const char *ke_fmt;
+    uint32_t ke_args[KTRACE_NARGS];
+};
+
+struct ktrace_buf {
+    uint32_t kb_head;           /* events recorded; free-running */
+    struct ktrace_ent kb_ents[KTRACE_NENTS];
+};
+
+extern struct ktrace_buf ktrace_bufs[NCPU];
+extern bool ktrace_enabled;
+
+#define ktrace(...) \
+    ktrace_args(__VA_ARGS__, 0, 0, 0, 0, 0, 0, 0)
+#define ktrace_args(fmt, a0, a1, a2, a3, a4, a5, ...) \
+    ktrace_record(fmt, (uint32_t) (a0), (uint32_t) (a1), (uint32_t) (a2), \
+                  (uint32_t) (a3), (uint32_t) (a4), (uint32_t) (a5))
+
+static inline void ktrace_record(const char *fmt, uint32_t a0, uint32_t a1,
+        uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+    struct ktrace_buf *kb;
+    struct ktrace_ent *ke;
+
+    if (!ktrace_enabled)
+        return;
+    /* Claiming the slot is one instruction, so an interrupt can't hand it
+     * out twice */
+    kb = &ktrace_bufs[cpunum()];
+    ke = &kb->kb_ents[local_add(&kb->kb_head, 1) % KTRACE_NENTS];
+    ke->ke_tsc = read_tsc();
+    ke->ke_fmt = fmt;
+    ke->ke_args[0] = a0;
+    ke->ke_args[1] = a1;
+    ke->ke_args[2] = a2;
+    ke->ke_args[3] = a3;
+    ke->ke_args[4] = a4;
+    ke->ke_args[5] = a5;
+}
+
+void ktrace_dump(int nents);
+
+#endif /* !JOS_KERN_KTRACE_H */
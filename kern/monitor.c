@@ -12,6 +12,11 @@
 #include <kern/console.h>
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
+#include <kern/pmap.h>
+#include <kern/ksm.h>
+#include <kern/kclock.h>
+#include <kern/klog.h>
+#include <kern/ktrace.h>
 
 #define CMDBUF_SIZE 80  /* enough for one VGA text line */
 
@@ -27,6 +32,17 @@ static struct command commands[] = {
     { "help", "Display this list of commands", mon_help },
     { "kerninfo", "Display information about the kernel", mon_kerninfo },
     { "backtrace", "Display stack backtrace", mon_backtrace },
+    { "meminfo", "Display physical memory statistics", mon_meminfo },
+    { "ksm", "Merge identical pages in mergeable ranges", mon_ksm },
+    { "compact", "Compact physical memory", mon_compact },
+    { "pgbench", "Time page_alloc/page_free [rounds]", mon_pgbench },
+    { "serialbench", "Measure serial throughput [bytes [baud]]",
+      mon_serialbench },
+    { "cons", "List console devices, or switch one [name on|off]", mon_cons },
+    { "dmesg", "Show the kernel log [-l maxlevel] [-n conslevel] [text]",
+      mon_dmesg },
+    { "tracedump", "Show recent trace events [count|on|off]", mon_tracedump },
+    { "loglevel", "Show or set klog thresholds [subsys level]", mon_loglevel },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -89,6 +105,184 @@ int mon_backtrace(int argc, char **argv, struct trapframe *tf)
 }
 
 
+int mon_meminfo(int argc, char **argv, struct trapframe *tf)
+{
+    volatile struct page_stats *ps = page_stats;
+
+    cprintf("Physical pages:  %u (%u with metadata)\n",
+            ps->ps_npages, ps->ps_npage_infos);
+    cprintf("Free base:       %u\n", ps->ps_nfree[PZONE_BASE]);
+    cprintf("Free extended:   %u\n", ps->ps_nfree[PZONE_EXT]);
+    cprintf("Free high:       %u\n", ps->ps_nfree[PZONE_HIGH]);
+    cprintf("Allocations:     %u (%u zeroed, %u failed)\n",
+            ps->ps_nalloc, ps->ps_nalloc_zero, ps->ps_nalloc_failed);
+    cprintf("Frees:           %u\n", ps->ps_nfree_calls);
+    cprintf("Merged (saved):  %u\n", ps->ps_nmerged);
+    return 0;
+}
+
+int mon_ksm(int argc, char **argv, struct trapframe *tf)
+{
+    int n = ksm_scan();
+
+    cprintf("Merged %d pages, %u pages saved in total\n",
+            n, page_stats->ps_nmerged);
+    return 0;
+}
+
+
+int mon_compact(int argc, char **argv, struct trapframe *tf)
+{
+    size_t maxrun, nsuper;
+    int n;
+
+    page_free_runs(&maxrun, &nsuper);
+    cprintf("Before: largest free block %uK, %u free %uK blocks\n",
+            maxrun * PGSIZE / 1024, nsuper, PTSIZE / 1024);
+    n = page_compact(kern_pgdir);
+    page_free_runs(&maxrun, &nsuper);
+    cprintf("After:  largest free block %uK, %u free %uK blocks\n",
+            maxrun * PGSIZE / 1024, nsuper, PTSIZE / 1024);
+    cprintf("%d pages migrated\n", n);
+    return 0;
+}
+
+int mon_pgbench(int argc, char **argv, struct trapframe *tf)
+{
+    int nrounds = argc > 1 ? strtol(argv[1], NULL, 0) : 1000;
+    uint64_t cycles;
+    int n;
+
+    if (!(n = page_alloc_bench(nrounds, &cycles))) {
+        cprintf("pgbench: no free pages\n");
+        return 0;
+    }
+    cprintf("%d page_alloc/page_free pairs, %llu cycles each\n",
+            n, cycles / n);
+    return 0;
+}
+
+int mon_serialbench(int argc, char **argv, struct trapframe *tf)
+{
+    size_t nbytes = argc > 1 ? strtol(argv[1], NULL, 0) : 4096;
+    unsigned baud = serial_get_baud();
+    uint64_t cycles;
+    size_t n;
+
+    if (argc > 2 && serial_set_baud(strtol(argv[2], NULL, 0)) < 0) {
+        cprintf("serialbench: baud rate must divide 115200\n");
+        return 0;
+    }
+    n = serial_bench(nbytes, &cycles);
+    cprintf("\n");
+    if (argc > 2) {
+        cprintf("serialbench: %u baud\n", serial_get_baud());
+        serial_set_baud(baud);
+    }
+    if (!n || !cycles) {
+        cprintf("serialbench: no serial port\n");
+        return 0;
+    }
+    cprintf("%u bytes in %llu cycles, %llu bytes/sec\n",
+            n, cycles, (uint64_t) n * tsc_freq() / cycles);
+    return 0;
+}
+
+int mon_cons(int argc, char **argv, struct trapframe *tf)
+{
+    struct cons_dev *cd;
+
+    if (argc == 3) {
+        if (strcmp(argv[2], "on") != 0 && strcmp(argv[2], "off") != 0)
+            goto usage;
+        if (cons_enable(argv[1], strcmp(argv[2], "on") == 0) < 0)
+            cprintf("cons: no device '%s'\n", argv[1]);
+        return 0;
+    }
+    if (argc != 1)
+        goto usage;
+
+    for (cd = cons_devs; cd < cons_devs + ncons_devs; cd++) {
+        cprintf("%-9s %-7s %-3s", cd->cd_name,
+                cd->cd_present ? "present" : "absent",
+                cd->cd_enabled ? "on" : "off");
+        if (cd->cd_nbytes)
+            cprintf(" %llu bytes, %llu cycles/byte", cd->cd_nbytes,
+                    cd->cd_cycles / cd->cd_nbytes);
+        cprintf("\n");
+    }
+    return 0;
+
+usage:
+    cprintf("usage: cons [name on|off]\n");
+    return 0;
+}
+
+int mon_dmesg(int argc, char **argv, struct trapframe *tf)
+{
+    int maxlevel = KLOG_DEBUG;
+    const char *match = NULL;
+    int i, level;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-l") != 0 && strcmp(argv[i], "-n") != 0) {
+            match = argv[i];
+            continue;
+        }
+        if (i + 1 == argc)
+            goto usage;
+        level = strtol(argv[i + 1], NULL, 0);
+        if (level < 0 || level >= NKLOG_LEVELS)
+            goto usage;
+        if (argv[i][1] == 'l')
+            maxlevel = level;
+        else
+            klog_console_level = level;
+        i++;
+    }
+    klog_dump(maxlevel, match);
+    return 0;
+
+usage:
+    cprintf("usage: dmesg [-l maxlevel] [-n conslevel] [text], "
+            "levels 0-%d\n", NKLOG_LEVELS - 1);
+    return 0;
+}
+
+int mon_tracedump(int argc, char **argv, struct trapframe *tf)
+{
+    if (argc > 1 && strcmp(argv[1], "on") == 0)
+        ktrace_enabled = true;
+    else if (argc > 1 && strcmp(argv[1], "off") == 0)
+        ktrace_enabled = false;
+    else
+        ktrace_dump(argc > 1 ? strtol(argv[1], NULL, 0) : 32);
+    return 0;
+}
+
+int mon_loglevel(int argc, char **argv, struct trapframe *tf)
+{
+    int i;
+
+    if (argc == 3) {
+        if (klog_set_level(argv[1], strtol(argv[2], NULL, 0)) < 0)
+            cprintf("loglevel: bad subsystem or level (0-%d)\n",
+                    NKLOG_LEVELS - 1);
+        return 0;
+    }
+    if (argc != 1) {
+        cprintf("usage: loglevel [subsys level]\n");
+        return 0;
+    }
+
+    for (i = 0; i < NKS; i++)
+        cprintf("%-5s %d  %u suppressed\n", klog_subsys_names[i],
+                klog_subsys_level[i], klog_subsys_nsuppressed[i]);
+    cprintf("console %d\n", klog_console_level);
+    return 0;
+}
+
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
@@ -17,5 +17,14 @@ void monitor(struct trapframe *tf);
 int mon_help(int argc, char **argv, struct trapframe *tf);
 int mon_kerninfo(int argc, char **argv, struct trapframe *tf);
 int mon_backtrace(int argc, char **argv, struct trapframe *tf);
+int mon_meminfo(int argc, char **argv, struct trapframe *tf);
+int mon_ksm(int argc, char **argv, struct trapframe *tf);
+int mon_compact(int argc, char **argv, struct trapframe *tf);
+int mon_pgbench(int argc, char **argv, struct trapframe *tf);
+int mon_serialbench(int argc, char **argv, struct trapframe *tf);
+int mon_cons(int argc, char **argv, struct trapframe *tf);
+int mon_dmesg(int argc, char **argv, struct trapframe *tf);
+int mon_tracedump(int argc, char **argv, struct trapframe *tf);
+int mon_loglevel(int argc, char **argv, struct trapframe *tf);
 
 #endif /* !JOS_KERN_MONITOR_H */
@@ -8,14 +8,104 @@
 
 #include <kern/pmap.h>
 #include <kern/kclock.h>
+#include <kern/vmalloc.h>
+#include <kern/ktrace.h>
+#include <kern/klog.h>
 
 /* These variables are set by i386_detect_memory() */
 size_t npages;                  /* Amount of physical memory (in pages) */
+size_t npages_lowmem;           /* Pages mapped at KERNBASE (in pages) */
 static size_t npages_basemem;   /* Amount of base memory (in pages) */
+static size_t npages_below4g;   /* Top of RAM below 4GB (in pages) */
+
+/* Pages below 4GB.  A PAE kernel may find RAM above this, past a hole. */
+#define NPAGES_4G       ((size_t) 1 << (32 - PGSHIFT))
+
+/* entry_pgdir maps this much at KERNBASE; boot_alloc has to stay inside it.
+ * The PAE entry_pgdir maps more, to leave room for the metadata of the
+ * larger memories a PAE kernel is built for.  Keep in step with
+ * kern/entrypgdir.c. */
+#ifdef JOS_PAE
+#define ENTRYMAPSIZE    (16 * 1024 * 1024)
+#define MAXPHYSPAGES    ((size_t) 1 << (36 - PGSHIFT))
+#else
+#define ENTRYMAPSIZE    (4 * 1024 * 1024)
+#define MAXPHYSPAGES    ((size_t) 1 << (32 - PGSHIFT))
+#endif
 
 /* These variables are set in mem_init() */
+pde_t *kern_pgdir;                       /* Kernel's initial page directory */
+#ifdef JOS_PAE
+/* Page directory pointer table for kern_pgdir's four directories */
+__attribute__((__aligned__(32))) uint64_t kern_pdpt[NPDPENTRIES];
+#endif
 struct page_info *pages;                 /* Physical page state array */
-static struct page_info *page_free_list; /* Free list of physical pages */
+struct page_info **page_sections;        /* Per-section metadata chunks */
+uint32_t *page_chunk_sect;               /* Section of each chunk in pages */
+size_t nsections;                        /* Entries in page_sections */
+size_t npage_infos;                      /* Entries in pages */
+volatile struct page_stats *page_stats;  /* Allocator counters */
+struct page_info *zero_page;             /* Shared page of zeroes */
+
+/*
+ * A free list that several CPUs, and interrupt handlers, can push to and pop
+ * from without a lock.  The head and a tag are swapped together with
+ * cmpxchg8b, and every update bumps the tag: a pop that read the head before
+ * another CPU popped that page and pushed it back (the ABA problem) then
+ * fails and retries, instead of installing the stale pp_link it read.
+ */
+union free_stack {
+    struct {
+        struct page_info *fs_head;
+        uint32_t fs_tag;
+    };
+    uint64_t fs_word;
+} __attribute__((__aligned__(8)));
+
+static union free_stack page_free_list;      /* Free list of physical pages */
+static union free_stack page_free_list_high; /* Free highmem pages */
+
+/*
+ * Per-CPU magazines of free pages in front of the free lists, one per list.
+ * page_alloc and page_free work on the current CPU's magazine and only touch
+ * the shared lists to refill an empty one or drain a full one, PAGE_MAG_BATCH
+ * pages at a time.  Pages in a magazine are still free: they have PP_FREE
+ * set and page_stats counts them.
+ */
+#define PAGE_MAG_SIZE   32
+#define PAGE_MAG_BATCH  16
+
+static struct page_magazine {
+    struct page_info *pm_pages[PAGE_MAG_SIZE];  /* [pm_n - 1] is the top */
+    int pm_n;
+} page_mags[NCPU][2];                           /* [cpu][highmem] */
+
+/* Lowest and highest va ever mapped with PTE_G, both inclusive so that a
+ * mapping that runs to the top of the address space does not wrap to 0.  A
+ * range flush that overlaps these must also drop global TLB entries. */
+static uintptr_t tlb_global_lo = ~0, tlb_global_last;
+
+/* The PAT MSR and the memory type encodings of its entries. */
+#define MSR_IA32_PAT    0x277
+#define PAT_UC          0x00
+#define PAT_WC          0x01
+#define PAT_WT          0x04
+#define PAT_WB          0x06
+#define PAT_UCMINUS     0x07
+#define PAT_ENTRY(i, t) ((uint64_t) (t) << ((i) * 8))
+#define CPUID_PGE       (1 << 13)   /* cpuid(1) %edx: has global pages */
+#define CPUID_PAT       (1 << 16)   /* cpuid(1) %edx: has the PAT */
+
+static bool pat_enabled;        /* set by pat_init() if the CPU has a PAT */
+
+/* kmap slots: which page each slot of each CPU's window holds, and how many
+ * kmap calls are still holding it.  kmap_ptes are the PTEs of the whole
+ * [KMAPBASE, KMAPLIM) window, which lives in a single page table. */
+static struct kmap_slot {
+    struct page_info *pp;
+    int count;
+} kmap_slots[NCPU][KMAP_NSLOTS];
+static pte_t *kmap_ptes;
 
 
 /***************************************************************
@@ -29,24 +119,76 @@ static int nvram_read(int r)
 
 static void i386_detect_memory(void)
 {
-    size_t npages_extmem;
+    extern char end[];
+    size_t npages_extmem, npages_ext16mem, npages_himem, maxpages;
+    size_t nhole, nram;
 
     /* Use CMOS calls to measure available base & extended memory.
-     * (CMOS calls return results in kilobytes.) */
+     * (CMOS calls return results in kilobytes, except for memory above
+     * 16MB, which is counted in 64KB units.) */
     npages_basemem = (nvram_read(NVRAM_BASELO) * 1024) / PGSIZE;
     npages_extmem = (nvram_read(NVRAM_EXTLO) * 1024) / PGSIZE;
+    npages_ext16mem = nvram_read(NVRAM_EXT16LO) * (64 * 1024 / PGSIZE);
 
     /* Calculate the number of physical pages available in both base and
      * extended memory. */
-    if (npages_extmem)
+    if (npages_ext16mem)
+        npages = (16 * 1024 * 1024) / PGSIZE + npages_ext16mem;
+    else if (npages_extmem)
         npages = (EXTPHYSMEM / PGSIZE) + npages_extmem;
     else
         npages = npages_basemem;
+    npages_below4g = npages;
+
+#ifdef JOS_PAE
+    /* RAM above 4GB is reported separately, and [npages_below4g, 4GB) in
+     * between is a hole (PCI space) that gets no page metadata. */
+    npages_himem = (mc146818_read(NVRAM_HIMEM0) |
+        (mc146818_read(NVRAM_HIMEM1) << 8) |
+        (mc146818_read(NVRAM_HIMEM2) << 16)) * (64 * 1024 / PGSIZE);
+    if (npages_himem)
+        npages = NPAGES_4G + npages_himem;
+#else
+    npages_himem = 0;
+#endif
+    npages = MIN(npages, MAXPHYSPAGES);
 
-    cprintf("Physical memory: %uK available, base = %uK, extended = %uK\n",
-        npages * PGSIZE / 1024,
+    /* Everything boot_alloc hands out has to fit in the ENTRYMAPSIZE that
+     * entry_pgdir maps.  The page metadata is the bulk of it; leave a few
+     * pages for kern_pgdir, the statistics page and the section tables, and
+     * ignore any memory we have no room to describe.  The metadata also has
+     * to fit below UPAGESTATS. */
+    maxpages = (ENTRYMAPSIZE - PADDR(ROUNDUP((char *) end, PGSIZE)) -
+        (NPDENTRIES * sizeof(pde_t) + 3 * PGSIZE)) /
+        (sizeof(struct page_info) + 1);
+    maxpages = MIN(maxpages, (UPAGESTATS - UPAGES) / sizeof(struct page_info));
+    maxpages = ROUNDDOWN(maxpages, NPGPERSECT);
+    nhole = npages > npages_below4g ? MIN(npages, NPAGES_4G) - npages_below4g
+                                    : 0;
+    nram = npages - nhole;
+    if (nram > maxpages) {
+        klog(KLOG_WARNING, KS_MEM, "using %uK of %uK physical memory\n",
+            maxpages * (PGSIZE / 1024), nram * (PGSIZE / 1024));
+        /* Drop memory from the top; if that reaches below 4GB, so does the
+         * hole. */
+        if (npages - (nram - maxpages) > NPAGES_4G)
+            npages = ROUNDDOWN(npages - (nram - maxpages), NPGPERSECT);
+        else {
+            npages = maxpages;
+            nhole = 0;
+        }
+    }
+    npages_below4g = MIN(npages_below4g, npages);
+    npages_lowmem = MIN(npages, NPAGES_DIRECT);
+    npages_extmem = npages_lowmem > EXTPHYSMEM / PGSIZE ?
+        npages_lowmem - EXTPHYSMEM / PGSIZE : 0;
+
+    cprintf("Physical memory: %uK available, base = %uK, extended = %uK, "
+        "high = %uK\n",
+        (npages - nhole) * (PGSIZE / 1024),
         npages_basemem * PGSIZE / 1024,
-        npages_extmem * PGSIZE / 1024);
+        npages_extmem * (PGSIZE / 1024),
+        (npages - npages_lowmem - nhole) * (PGSIZE / 1024));
 }
 
 
@@ -56,6 +198,65 @@ static void i386_detect_memory(void)
 
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
+static void check_page_stack(void);
+static void check_page_sections(void);
+static void check_kern_pgdir(void);
+static void check_page_cow(void);
+static void check_page_compact(void);
+static void check_kmap(void);
+static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size,
+        physaddr_t pa, int perm);
+static void tlb_note_global(uintptr_t va, size_t len);
+
+/*
+ * Program the page attribute table.  It keeps the power-on layout, except
+ * that entry 1 (PTE_PWT alone) becomes write-combining instead of
+ * write-through.  Entries 4-7, which PTE_PAT would select, mirror 0-3.
+ */
+static void pat_init(void)
+{
+    uint32_t edx;
+
+    cpuid(1, NULL, NULL, NULL, &edx);
+    if (!(edx & CPUID_PAT))
+        return;
+    wrmsr(MSR_IA32_PAT,
+          PAT_ENTRY(0, PAT_WB) | PAT_ENTRY(1, PAT_WC) |
+          PAT_ENTRY(2, PAT_UCMINUS) | PAT_ENTRY(3, PAT_UC) |
+          PAT_ENTRY(4, PAT_WB) | PAT_ENTRY(5, PAT_WC) |
+          PAT_ENTRY(6, PAT_UCMINUS) | PAT_ENTRY(7, PAT_UC));
+    tlbflush();
+    pat_enabled = true;
+}
+
+/*
+ * Turn on global pages, if the CPU has them.  The kernel's own mappings are
+ * made with PTE_G, so they stay in the TLB across cr3 reloads.  Called once
+ * kern_pgdir is loaded.
+ */
+static void pge_init(void)
+{
+    uint32_t edx;
+
+    cpuid(1, NULL, NULL, NULL, &edx);
+    if (edx & CPUID_PGE)
+        lcr4(rcr4() | CR4_PGE);
+}
+
+/* The PTE bits that select 'memtype'.  Without a PAT, WC degrades to UC. */
+static int memtype_bits(int memtype)
+{
+    switch (memtype) {
+    case MEMTYPE_WC:
+        if (pat_enabled)
+            return PTE_PWT;
+        /* fallthru */
+    case MEMTYPE_UC:
+        return PTE_PCD | PTE_PWT;
+    default:
+        return 0;
+    }
+}
 
 /* This simple physical memory allocator is used only while JOS is setting up
  * its virtual memory system.  page_alloc() is the real allocator.
@@ -84,11 +285,189 @@ static void *boot_alloc(uint32_t n)
     }
 
     /* Allocate a chunk large enough to hold 'n' bytes, then update nextfree.
-     * Make sure nextfree is kept aligned to a multiple of PGSIZE.
-     *
-     * LAB 1: Your code here.
-     */
-    return NULL;
+     * Make sure nextfree is kept aligned to a multiple of PGSIZE. */
+    result = nextfree;
+    if (n > 0) {
+        nextfree = ROUNDUP(nextfree + n, PGSIZE);
+        if (PPN(PADDR(nextfree)) > MIN(npages, ENTRYMAPSIZE / PGSIZE))
+            panic("boot_alloc: out of memory");
+    }
+    return result;
+}
+
+/* Does physical page 'pa' lie in usable RAM, as reported by the CMOS? */
+static bool pa_is_ram(physaddr_t pa)
+{
+    if (pa < npages_basemem * PGSIZE)
+        return true;
+    if (pa < EXTPHYSMEM || PPN(pa) >= npages)
+        return false;
+    return PPN(pa) < npages_below4g || PPN(pa) >= NPAGES_4G;
+}
+
+/* Does section 's' overlap usable RAM anywhere? */
+static bool section_has_ram(size_t s)
+{
+    size_t first = s * NPGPERSECT;
+
+    if (first < npages_basemem)
+        return true;
+    if (first + NPGPERSECT <= EXTPHYSMEM / PGSIZE || first >= npages)
+        return false;
+    return first < npages_below4g || first >= NPAGES_4G;
+}
+
+/*
+ * Lay out the page metadata.  Sections entirely inside a hole (the IO hole,
+ * for one) get no 'struct page_info's at all; the chunks of the remaining
+ * sections are carved consecutively out of one boot_alloc'ed array.
+ */
+static void page_sections_init(void)
+{
+    size_t s, n;
+
+    nsections = ROUNDUP(npages, NPGPERSECT) / NPGPERSECT;
+    page_sections = boot_alloc(nsections * sizeof(struct page_info *));
+    memset(page_sections, 0, nsections * sizeof(struct page_info *));
+
+    npage_infos = 0;
+    for (s = 0; s < nsections; s++)
+        if (section_has_ram(s))
+            npage_infos += NPGPERSECT;
+
+    n = npage_infos * sizeof(struct page_info);
+    pages = boot_alloc(n);
+    memset(pages, 0, n);
+    page_chunk_sect = boot_alloc(npage_infos / NPGPERSECT * sizeof(uint32_t));
+
+    n = 0;
+    for (s = 0; s < nsections; s++) {
+        if (!section_has_ram(s))
+            continue;
+        page_sections[s] = &pages[n];
+        page_chunk_sect[n / NPGPERSECT] = s;
+        n += NPGPERSECT;
+    }
+
+    klog(KLOG_INFO, KS_MEM, "page metadata: %u of %u sections present, %uK\n",
+        npage_infos / NPGPERSECT, nsections,
+        npage_infos * sizeof(struct page_info) / 1024);
+}
+
+static int page_zone(struct page_info *pp)
+{
+    if (page2pa(pp) < EXTPHYSMEM)
+        return PZONE_BASE;
+    return page_is_highmem(pp) ? PZONE_HIGH : PZONE_EXT;
+}
+
+/* The free list of lowmem or highmem pages. */
+static union free_stack *page_free_list_cls(bool highmem)
+{
+    return highmem ? &page_free_list_high : &page_free_list;
+}
+
+/* The free list 'pp' belongs on. */
+static union free_stack *page_free_list_of(struct page_info *pp)
+{
+    return page_free_list_cls(page_is_highmem(pp));
+}
+
+static void free_stack_push(volatile union free_stack *st,
+        struct page_info *pp)
+{
+    union free_stack old, new;
+
+    /* A torn read of the two halves just makes the first cmpxchg8b fail,
+     * which also hands us the current value. */
+    old.fs_word = st->fs_word;
+    do {
+        pp->pp_link = old.fs_head;
+        new.fs_head = pp;
+        new.fs_tag = old.fs_tag + 1;
+    } while (!cmpxchg8b(&st->fs_word, &old.fs_word, new.fs_word));
+}
+
+/* Pop a page, or return NULL if the list is empty.  The page's pp_link is
+ * left as it was. */
+static struct page_info *free_stack_pop(volatile union free_stack *st)
+{
+    union free_stack old, new;
+
+    old.fs_word = st->fs_word;
+    do {
+        if (!old.fs_head)
+            return NULL;
+        /* The head may be allocated under us, but a 'struct page_info'
+         * stays readable, and the tag check rejects what we read then. */
+        new.fs_head = old.fs_head->pp_link;
+        new.fs_tag = old.fs_tag + 1;
+    } while (!cmpxchg8b(&st->fs_word, &old.fs_word, new.fs_word));
+    return old.fs_head;
+}
+
+/* Take a page from this CPU's lowmem or highmem magazine, refilling it from
+ * the free list if it is empty.  Returns NULL if both are empty. */
+static struct page_info *page_mag_alloc(bool highmem)
+{
+    uint32_t eflags = irq_save();
+    struct page_magazine *pm = &page_mags[cpunum()][highmem];
+    union free_stack *fl = page_free_list_cls(highmem);
+    struct page_info *pp = NULL;
+    int i, n;
+
+    if (!pm->pm_n) {
+        for (n = 0; n < PAGE_MAG_BATCH; n++)
+            if (!(pm->pm_pages[n] = free_stack_pop(fl)))
+                break;
+        /* keep the free list's order: its first page goes on top */
+        for (i = 0; i < n / 2; i++) {
+            pp = pm->pm_pages[i];
+            pm->pm_pages[i] = pm->pm_pages[n - 1 - i];
+            pm->pm_pages[n - 1 - i] = pp;
+        }
+        pm->pm_n = n;
+        pp = NULL;
+    }
+    if (pm->pm_n)
+        pp = pm->pm_pages[--pm->pm_n];
+    irq_restore(eflags);
+    return pp;
+}
+
+/* Put 'pp' in this CPU's magazine, first draining the bottom (least recently
+ * freed) PAGE_MAG_BATCH pages to the free list if it is full. */
+static void page_mag_free(struct page_info *pp)
+{
+    uint32_t eflags = irq_save();
+    struct page_magazine *pm = &page_mags[cpunum()][page_is_highmem(pp)];
+    int i;
+
+    if (pm->pm_n == PAGE_MAG_SIZE) {
+        for (i = 0; i < PAGE_MAG_BATCH; i++)
+            free_stack_push(page_free_list_of(pm->pm_pages[i]),
+                    pm->pm_pages[i]);
+        memmove(pm->pm_pages, pm->pm_pages + PAGE_MAG_BATCH,
+                (PAGE_MAG_SIZE - PAGE_MAG_BATCH) * sizeof(pm->pm_pages[0]));
+        pm->pm_n -= PAGE_MAG_BATCH;
+    }
+    pm->pm_pages[pm->pm_n++] = pp;
+    irq_restore(eflags);
+}
+
+/* Return everything in this CPU's magazines to the free lists. */
+static void page_mag_drain(void)
+{
+    uint32_t eflags = irq_save();
+    struct page_magazine *pm;
+    int h;
+
+    for (h = 0; h < 2; h++) {
+        pm = &page_mags[cpunum()][h];
+        while (pm->pm_n)
+            free_stack_push(page_free_list_cls(h), pm->pm_pages[--pm->pm_n]);
+    }
+    irq_restore(eflags);
 }
 
 /*
@@ -104,21 +483,46 @@ static void *boot_alloc(uint32_t n)
 void mem_init(void)
 {
     uint32_t cr0;
-    size_t n;
+    size_t i, n;
 
     /* Find out how much memory the machine has (npages & npages_basemem). */
     i386_detect_memory();
+    pat_init();
+
+    /*********************************************************************
+     * create initial page directory.
+     */
+    kern_pgdir = (pde_t *) boot_alloc(NPDENTRIES * sizeof(pde_t));
+    memset(kern_pgdir, 0, NPDENTRIES * sizeof(pde_t));
+#ifdef JOS_PAE
+    for (i = 0; i < NPDPENTRIES; i++)
+        kern_pdpt[i] = (PADDR(kern_pgdir) + i * PGSIZE) | PTE_P;
+#endif
 
-    /* Remove this line when you're ready to test this function. */
-    panic("mem_init: This function is not finished\n");
+    /*********************************************************************
+     * Recursively insert PD in itself as a page table, to form a virtual
+     * page table at virtual address UVPT.  (Each page of a PAE page
+     * directory gets a PDE of its own.)
+     * Permissions: kernel R, user R
+     */
+    for (i = 0; i < UVPTSIZE / PTSIZE; i++)
+        kern_pgdir[PDX(UVPT) + i] = (PADDR(kern_pgdir) + i * PGSIZE) |
+            PTE_U | PTE_P;
 
     /*********************************************************************
-     * Allocate an array of npages 'struct page_info's and store it in 'pages'.
-     * The kernel uses this array to keep track of physical pages: for each
-     * physical page, there is a corresponding struct page_info in this array.
-     * 'npages' is the number of physical pages in memory.  Your code goes here.
+     * Allocate the 'struct page_info's, one per physical page in every
+     * section that holds usable RAM, and the page_sections table that
+     * pa2page() and page2pa() use to find them.
      */
+    page_sections_init();
 
+    /* The statistics page is exported to user space whole, so it gets a
+     * page of its own. */
+    page_stats = boot_alloc(PGSIZE);
+    memset((void *) page_stats, 0, PGSIZE);
+    page_stats->ps_version = PAGE_STATS_VERSION;
+    page_stats->ps_npages = npages;
+    page_stats->ps_npage_infos = npage_infos;
 
     /*********************************************************************
      * Now that we've allocated the initial kernel data structures, we set
@@ -130,13 +534,90 @@ void mem_init(void)
 
     check_page_free_list(1);
     check_page_alloc();
+    check_page_stack();
+    check_page_sections();
+
+    if (!(zero_page = page_alloc(ALLOC_ZERO)))
+        panic("mem_init: no memory for the zero page");
+    zero_page->pp_ref++;
 
-    /* ... lab 2 will set up page tables here ... */
+    /*********************************************************************
+     * Map 'pages' read-only by the user at linear address UPAGES, and the
+     * statistics page at UPAGESTATS, just below UVPT.
+     * Permissions:
+     *    - the new image at UPAGES -- kernel R, user R
+     *      (ie. perm = PTE_U | PTE_P)
+     *    - pages itself -- kernel RW, user NONE
+     */
+    n = ROUNDUP(npage_infos * sizeof(struct page_info), PGSIZE);
+    if (UPAGES + n > UPAGESTATS)
+        panic("mem_init: page_info array does not fit below UPAGESTATS");
+    boot_map_region(kern_pgdir, UPAGES, n, PADDR(pages), PTE_U);
+    boot_map_region(kern_pgdir, UPAGESTATS, PGSIZE,
+            PADDR((void *) page_stats), PTE_U);
+
+    /*********************************************************************
+     * Use the physical memory that 'bootstack' refers to as the kernel
+     * stack.  The kernel stack grows down from virtual address KSTACKTOP.
+     *     [KSTACKTOP-KSTKSIZE, KSTACKTOP) -- backed by physical memory
+     *     [KSTACKTOP-PTSIZE, KSTACKTOP-KSTKSIZE) -- not backed; so if
+     *       the kernel overflows its stack, it will fault rather than
+     *       overwrite memory.
+     * Permissions: kernel RW, user NONE
+     */
+    boot_map_region(kern_pgdir, KSTACKTOP - KSTKSIZE, KSTKSIZE,
+            PADDR(bootstack), PTE_W | PTE_G);
+
+    /*********************************************************************
+     * Map all of physical memory at KERNBASE.
+     * Ie.  the VA range [KERNBASE, 2^32) should map to
+     *      the PA range [0, 2^32 - KERNBASE)
+     * Permissions: kernel RW, user NONE, global
+     *
+     * The IO hole is device memory (the VGA frame buffer among it) and is
+     * mapped uncacheable, so that it never aliases the write-combining
+     * mapping mmio_map_region gives the same frames with a cacheable one.
+     */
+    boot_map_region(kern_pgdir, KERNBASE, IOPHYSMEM, 0, PTE_W | PTE_G);
+    boot_map_region(kern_pgdir, KERNBASE + IOPHYSMEM, EXTPHYSMEM - IOPHYSMEM,
+            IOPHYSMEM, PTE_W | PTE_G | memtype_bits(MEMTYPE_UC));
+    boot_map_region(kern_pgdir, KERNBASE + EXTPHYSMEM,
+            -(KERNBASE + EXTPHYSMEM), EXTPHYSMEM, PTE_W | PTE_G);
+
+    /*********************************************************************
+     * Allocate the page table for the kmap windows up front, so kmap never
+     * has to allocate memory.
+     */
+    if (!(kmap_ptes = pgdir_walk(kern_pgdir, (void *) KMAPBASE, 1)))
+        panic("mem_init: no memory for the kmap page table");
+
+    /* Switch from the minimal entry page directory to the full kern_pgdir
+     * page table we just created.  Our instruction pointer should be
+     * somewhere between KERNBASE and KERNBASE+4MB right now, which is
+     * mapped the same way by both page tables. */
+#ifdef JOS_PAE
+    lcr3(PADDR(kern_pdpt));
+#else
+    lcr3(PADDR(kern_pgdir));
+#endif
+
+    /* entry.S set the really important flags in cr0 (including enabling
+     * paging).  Here we configure the rest of the flags that we care about. */
+    cr0 = rcr0();
+    cr0 |= CR0_PE|CR0_PG|CR0_AM|CR0_WP|CR0_NE|CR0_MP;
+    cr0 &= ~(CR0_TS|CR0_EM);
+    lcr0(cr0);
+    pge_init();
+
+    check_kern_pgdir();
+    check_page_cow();
+    check_page_compact();
+    check_kmap();
 }
 
 /***************************************************************
  * Tracking of physical pages.
- * The 'pages' array has one 'struct page_info' entry per physical page.
+ * Every physical page in a present section has one 'struct page_info' entry.
  * Pages are reference counted, and free pages are kept on a linked list.
  ***************************************************************/
 
@@ -162,14 +643,32 @@ void page_init(void)
      *     memory?  Which pages are already in use for page tables and other
      *     data structures?
      *
-     * Change the code to reflect this.
+     * Pages of a present section that are not RAM at all (the tail of
+     * base memory or of the last section) are never put on the free list.
      * NB: DO NOT actually touch the physical memory corresponding to free
      *     pages! */
-    size_t i;
-    for (i = 0; i < npages; i++) {
-        pages[i].pp_ref = 0;
-        pages[i].pp_link = page_free_list;
-        page_free_list = &pages[i];
+    physaddr_t first_free = PADDR(boot_alloc(0));
+    struct page_info *pp;
+    physaddr_t pa;
+    size_t s, i;
+
+    for (s = 0; s < nsections; s++) {
+        if (!page_sections[s])
+            continue;
+        for (i = 0; i < NPGPERSECT; i++) {
+            pp = &page_sections[s][i];
+            pa = page2pa(pp);
+            pp->pp_ref = 0;
+            pp->pp_link = NULL;
+            pp->pp_flags = 0;
+            if (pa == 0 || !pa_is_ram(pa))
+                continue;
+            if (pa >= EXTPHYSMEM && pa < first_free)
+                continue;
+            pp->pp_flags = PP_FREE;
+            free_stack_push(page_free_list_of(pp), pp);
+            page_stats->ps_nfree[page_zone(pp)]++;
+        }
     }
 }
 
@@ -179,6 +678,12 @@ void page_init(void)
  * count of the page - the caller must do these if necessary (either explicitly
  * or via page_insert).
  *
+ * Only an ALLOC_HIGHMEM request may get a page beyond the direct map; those
+ * are handed out first so lowmem is kept for callers that need it.
+ *
+ * page_alloc and page_free take no lock and may run concurrently on several
+ * CPUs and in interrupt handlers.
+ *
  * Be sure to set the pp_link field of the allocated page to NULL so
  * page_free can check for double-free bugs.
  *
@@ -188,8 +693,31 @@ void page_init(void)
  */
 struct page_info *page_alloc(int alloc_flags)
 {
-    /* Fill this function in */
-    return 0;
+    struct page_info *pp = NULL;
+    void *kva;
+
+    if (alloc_flags & ALLOC_HIGHMEM)
+        pp = page_mag_alloc(true);
+    if (!pp)
+        pp = page_mag_alloc(false);
+
+    if (!pp) {
+        atomic_add(&page_stats->ps_nalloc_failed, 1);
+        return NULL;
+    }
+    pp->pp_link = NULL;
+    pp->pp_flags = (alloc_flags & ALLOC_MOVABLE) ? PP_MOVABLE : 0;
+    atomic_add(&page_stats->ps_nfree[page_zone(pp)], -1);
+    atomic_add(&page_stats->ps_nalloc, 1);
+    if (alloc_flags & ALLOC_ZERO)
+        atomic_add(&page_stats->ps_nalloc_zero, 1);
+
+    if (alloc_flags & ALLOC_ZERO) {
+        kva = kmap(pp);
+        memset(kva, 0, PGSIZE);
+        kunmap(kva);
+    }
+    return pp;
 }
 
 /*
@@ -198,9 +726,46 @@ struct page_info *page_alloc(int alloc_flags)
  */
 void page_free(struct page_info *pp)
 {
-    /* Fill this function in
-     * Hint: You may want to panic if pp->pp_ref is nonzero or
-     * pp->pp_link is not NULL. */
+    if (pp->pp_ref || pp->pp_link || (pp->pp_flags & PP_FREE))
+        panic("page_free: page %08llx is still in use",
+            (uint64_t) page2pa(pp));
+    pp->pp_flags = PP_FREE;
+    page_mag_free(pp);
+
+    atomic_add(&page_stats->ps_nfree[page_zone(pp)], 1);
+    atomic_add(&page_stats->ps_nfree_calls, 1);
+}
+
+/*
+ * Allocator benchmark behind the pgbench monitor command: 'nrounds' rounds
+ * of allocating up to PGBENCH_BATCH pages and freeing them again, the odd
+ * ones first so the free list does not just stay in LIFO order.  Stores the
+ * TSC cycles taken in *cycles and returns the number of page_alloc and
+ * page_free pairs done.  Run on several CPUs at once, it shows how the free
+ * lists scale.
+ */
+#define PGBENCH_BATCH   32
+
+int page_alloc_bench(int nrounds, uint64_t *cycles)
+{
+    struct page_info *batch[PGBENCH_BATCH];
+    uint64_t start = read_tsc();
+    int r, i, n, npairs = 0;
+
+    for (r = 0; r < nrounds; r++) {
+        for (n = 0; n < PGBENCH_BATCH; n++)
+            if (!(batch[n] = page_alloc(0)))
+                break;
+        for (i = 1; i < n; i += 2)
+            page_free(batch[i]);
+        for (i = 0; i < n; i += 2)
+            page_free(batch[i]);
+        npairs += n;
+        if (n < PGBENCH_BATCH)
+            break;
+    }
+    *cycles = read_tsc() - start;
+    return npairs;
 }
 
 /*
@@ -213,6 +778,680 @@ void page_decref(struct page_info* pp)
         page_free(pp);
 }
 
+/*
+ * Keep page_compact from moving 'pp', e.g. because something other than a
+ * page table entry now refers to its physical address.
+ */
+void page_pin(struct page_info *pp)
+{
+    pp->pp_flags &= ~PP_MOVABLE;
+}
+
+
+/***************************************************************
+ * Compaction of free physical memory.
+ ***************************************************************/
+
+/*
+ * Find the largest run of physically contiguous free pages (in pages), and
+ * the number of free, PTSIZE-aligned PTSIZE blocks (superpages).
+ */
+void page_free_runs(size_t *maxrun, size_t *nsuper)
+{
+    struct page_info *pp;
+    physaddr_t pa, next = 0;
+    size_t run = 0;
+
+    *maxrun = *nsuper = 0;
+    for (pp = pages; pp < pages + npage_infos; pp++) {
+        pa = page2pa(pp);
+        if (!(pp->pp_flags & PP_FREE) || pa != next)
+            run = 0;
+        next = pa + PGSIZE;
+        if (!(pp->pp_flags & PP_FREE))
+            continue;
+        if (++run > *maxrun)
+            *maxrun = run;
+        if (run >= NPTENTRIES && (next & (PTSIZE - 1)) == 0)
+            ++*nsuper;
+    }
+}
+
+/* Rebuild the free lists from the PP_FREE flags, lowest address first.
+ * Unlike page_alloc and page_free, this needs every other CPU to stay out of
+ * the allocator meanwhile. */
+static void page_free_list_rebuild(void)
+{
+    struct page_info *pp;
+    int z;
+
+    for (z = 0; z < NPZONES; z++)
+        page_stats->ps_nfree[z] = 0;
+    page_free_list.fs_head = page_free_list_high.fs_head = NULL;
+    memset(page_mags, 0, sizeof(page_mags));
+    for (pp = pages + npage_infos; pp-- > pages; ) {
+        pp->pp_link = NULL;
+        if (!(pp->pp_flags & PP_FREE))
+            continue;
+        free_stack_push(page_free_list_of(pp), pp);
+        page_stats->ps_nfree[page_zone(pp)]++;
+    }
+}
+
+/*
+ * Migrate movable pages mapped in 'pgdir' towards the top of physical
+ * memory, so that free memory coalesces into large contiguous runs at the
+ * bottom.  A page is moved only if it is PP_MOVABLE and its single
+ * reference is the PTE we find it through, so fixing up that one PTE is
+ * all it takes; shared pages stay put.  The kernel's direct map at KERNBASE
+ * and the UVPT self-map are not scanned.  Pages stay on their side of the
+ * lowmem/highmem boundary, so the free scanner runs separately for each.
+ *
+ * Returns the number of pages migrated.
+ */
+int page_compact(pde_t *pgdir)
+{
+    struct page_info *pp, *np, **top, *tops[2];
+    struct tlb_batch tb;
+    uint32_t pdx, ptx;
+    void *src, *dst;
+    pte_t *pt;
+    physaddr_t pa;
+    int nmoved = 0;
+
+    for (tops[0] = pages; tops[0] < pages + npage_infos; tops[0]++)
+        if (page_is_highmem(tops[0]))
+            break;
+    tops[1] = pages + npage_infos;
+
+    tlb_batch_begin(&tb, pgdir);
+    for (pdx = 0; pdx < PDX(KERNBASE); pdx++) {
+        if ((pdx >= PDX(UVPT) && pdx < PDX(UVPT + UVPTSIZE)) ||
+                (pgdir[pdx] & (PTE_P | PTE_PS)) != PTE_P)
+            continue;
+        pt = KADDR(PTE_ADDR(pgdir[pdx]));
+        for (ptx = 0; ptx < NPTENTRIES; ptx++) {
+            if (!(pt[ptx] & PTE_P))
+                continue;
+            pa = PTE_ADDR(pt[ptx]);
+            if (PPN(pa) >= npages || !page_sections[PGSECT(pa)])
+                continue;
+            pp = pa2page(pa);
+            if (!(pp->pp_flags & PP_MOVABLE) || pp->pp_ref != 1)
+                continue;
+
+            /* free scanner: highest free page above the one to move */
+            top = &tops[page_is_highmem(pp)];
+            while (*top > pp + 1 && !((*top)[-1].pp_flags & PP_FREE))
+                --*top;
+            if (*top <= pp + 1)
+                continue;
+            np = --*top;
+
+            dst = kmap(np);
+            src = kmap(pp);
+            memcpy(dst, src, PGSIZE);
+            kunmap(src);
+            kunmap(dst);
+            np->pp_flags = pp->pp_flags;
+            np->pp_ref = 1;
+            pt[ptx] = page2pa(np) | PGOFF(pt[ptx]);
+            tlb_batch_add(&tb, PGADDR(pdx, ptx, 0));
+            ktrace("page_compact va %08x ppn %x -> %x",
+                   PGADDR(pdx, ptx, 0), PPN(page2pa(pp)), PPN(page2pa(np)));
+            pp->pp_ref = 0;
+            pp->pp_flags = PP_FREE;
+            nmoved++;
+        }
+    }
+    tlb_batch_commit(&tb);
+    page_free_list_rebuild();
+    return nmoved;
+}
+
+
+/*
+ * Zeroed page-table pages kept ready for pgdir_walk, per CPU.  A table
+ * released with pgdir_free_pt comes back here after having its remaining
+ * entries cleared one by one, so building a new table seldom has to zero a
+ * whole page.  Cached tables have pp_ref 0 but are not free.
+ */
+#define PGTABLE_CACHE_SIZE  8
+
+static struct pgtable_cache {
+    struct page_info *pc_pages[PGTABLE_CACHE_SIZE];
+    int pc_n;
+} pgtable_caches[NCPU];
+
+/* A zeroed lowmem page to use as a page table, or NULL if out of memory. */
+static struct page_info *pgtable_alloc(void)
+{
+    uint32_t eflags = irq_save();
+    struct pgtable_cache *pc = &pgtable_caches[cpunum()];
+    struct page_info *pp = pc->pc_n ? pc->pc_pages[--pc->pc_n] : NULL;
+
+    irq_restore(eflags);
+    return pp ? pp : page_alloc(ALLOC_ZERO);
+}
+
+/*
+ * Given 'pgdir', a pointer to a page directory, pgdir_walk returns a pointer
+ * to the page table entry (PTE) for linear address 'va'.  This requires
+ * walking the two-level page table structure.
+ *
+ * The relevant page table page might not exist yet.  If this is true and
+ * create == false, then pgdir_walk returns NULL.  Otherwise, pgdir_walk
+ * takes a zeroed page table page from the page-table cache (or page_alloc),
+ * increments its refcount and returns a pointer into it, or NULL if the
+ * allocation fails.
+ *
+ * A large-page PDE (PTE_PS) has no page table behind it: a lookup returns
+ * NULL and a create panics rather than treating the large page as one.
+ *
+ * For lookups in the current address space that only need the PTE's value,
+ * pte_lookup() in kern/pmap.h is cheaper.
+ */
+pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create)
+{
+    pde_t *pde = &pgdir[PDX(va)];
+    struct page_info *pp;
+
+    if ((*pde & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS)) {
+        if (create)
+            panic("pgdir_walk: %08x is inside a large page", va);
+        return NULL;
+    }
+    if (!(*pde & PTE_P)) {
+        if (!create || !(pp = pgtable_alloc()))
+            return NULL;
+        pp->pp_ref++;
+        *pde = page2pa(pp) | PTE_P | PTE_W | PTE_U;
+    }
+    return (pte_t *) KADDR(PTE_ADDR(*pde)) + PTX(va);
+}
+
+/*
+ * Remove the page table that maps 'va' from 'pgdir' and drop the
+ * directory's reference to it.  A table that other directories still point
+ * to is left as it is.  Otherwise any pages still mapped through it are
+ * page_remove'd, only the entries still in use are cleared, and the table
+ * goes back to the page-table cache rather than to the free list.
+ */
+void pgdir_free_pt(pde_t *pgdir, void *va)
+{
+    char *base = ROUNDDOWN((char *) va, PTSIZE);
+    pde_t *pde = &pgdir[PDX(va)];
+    struct pgtable_cache *pc;
+    struct page_info *pp;
+    uint32_t eflags;
+    pte_t *pt;
+    int i;
+
+    if ((*pde & (PTE_P | PTE_PS)) != PTE_P)
+        return;
+    pp = pa2page(PTE_ADDR(*pde));
+    if (pp->pp_ref > 1) {
+        *pde = 0;
+        tlb_invalidate_range(pgdir, base, PTSIZE);
+        page_decref(pp);
+        return;
+    }
+
+    pt = KADDR(PTE_ADDR(*pde));
+    for (i = 0; i < NPTENTRIES; i++) {
+        if (!pt[i])
+            continue;
+        if (pt[i] & PTE_P)
+            page_remove(pgdir, base + i * PGSIZE);
+        pt[i] = 0;
+    }
+
+    *pde = 0;
+    tlb_invalidate_range(pgdir, base, PTSIZE);
+
+    eflags = irq_save();
+    pc = &pgtable_caches[cpunum()];
+    if (pp->pp_ref == 1 && pc->pc_n < PGTABLE_CACHE_SIZE) {
+        pp->pp_ref = 0;
+        pc->pc_pages[pc->pc_n++] = pp;
+        pp = NULL;
+    }
+    irq_restore(eflags);
+    if (pp)
+        page_decref(pp);
+}
+
+/*
+ * Map [va, va+size) of virtual address space to physical [pa, pa+size)
+ * in the page table rooted at pgdir.  Size is a multiple of PGSIZE, and
+ * va and pa are both page-aligned.
+ * Use permission bits perm|PTE_P for the entries.
+ *
+ * A PAE kernel maps each PTSIZE-aligned 2MB stretch with a single large
+ * page instead of a page table.
+ *
+ * This function is only intended to set up the ``static'' mappings
+ * above UTOP.  As such, it should *not* change the pp_ref field on the
+ * mapped pages.
+ */
+static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size,
+        physaddr_t pa, int perm)
+{
+    size_t off;
+    pte_t *pte;
+
+    if (perm & PTE_G)
+        tlb_note_global(va, size);
+    for (off = 0; off < size; off += PGSIZE) {
+#ifdef JOS_PAE
+        if (((va + off) | (pa + off)) % PTSIZE == 0 && size - off >= PTSIZE &&
+                !(pgdir[PDX(va + off)] & PTE_P)) {
+            pgdir[PDX(va + off)] = (pa + off) | perm | PTE_P | PTE_PS;
+            off += PTSIZE - PGSIZE;
+            continue;
+        }
+#endif
+        if (!(pte = pgdir_walk(pgdir, (void *) (va + off), 1)))
+            panic("boot_map_region: out of memory");
+        *pte = (pa + off) | perm | PTE_P;
+    }
+}
+
+/*
+ * Map [pa, pa+size) of device memory into the MMIO region, kernel read/write
+ * with memory type 'memtype', and return the virtual address of 'pa'.  'pa'
+ * and 'size' need not be page aligned.  Mappings are never taken down; panics
+ * if the MMIO region is used up.
+ */
+void *mmio_map_region(physaddr_t pa, size_t size, int memtype)
+{
+    static uintptr_t base = MMIOBASE;
+    uintptr_t va = base;
+
+    size = ROUNDUP(size + PGOFF(pa), PGSIZE);
+    if (size > MMIOLIM - base)
+        panic("mmio_map_region: out of MMIO space");
+    boot_map_region(kern_pgdir, va, size, pa - PGOFF(pa),
+            PTE_W | memtype_bits(memtype));
+    base += size;
+    return (void *) (va + PGOFF(pa));
+}
+
+/*
+ * Map the physical page 'pp' at virtual address 'va'.
+ * The permissions (the low 12 bits) of the page table entry
+ * should be set to 'perm|PTE_P'.
+ *
+ * Requirements
+ *   - If there is already a page mapped at 'va', it should be page_remove()d.
+ *   - If necessary, on demand, a page table should be allocated and inserted
+ *     into 'pgdir'.
+ *   - pp->pp_ref should be incremented if the insertion succeeds.
+ *   - The TLB must be invalidated if a page was formerly present at 'va'.
+ *
+ * RETURNS:
+ *   0 on success
+ *   -E_NO_MEM, if page table couldn't be allocated
+ */
+int page_insert(pde_t *pgdir, struct page_info *pp, void *va, int perm)
+{
+    pte_t *pte = pgdir_walk(pgdir, va, 1);
+
+    if (!pte)
+        return -E_NO_MEM;
+    if (perm & PTE_G)
+        tlb_note_global((uintptr_t) va, PGSIZE);
+
+    /* Take the reference first, so re-inserting the same page at the same
+     * va does not free it in page_remove. */
+    pp->pp_ref++;
+    if (*pte & PTE_P)
+        page_remove(pgdir, va);
+    *pte = page2pa(pp) | perm | PTE_P;
+    return 0;
+}
+
+/*
+ * Return the page mapped at virtual address 'va'.
+ * If pte_store is not zero, then we store in it the address
+ * of the pte for this page.  This is used by page_remove and
+ * can be used to verify page permissions for syscall arguments,
+ * but should not be used by most callers.
+ *
+ * Return NULL if there is no page mapped at va.
+ */
+struct page_info *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
+{
+    pte_t *pte = pgdir_walk(pgdir, va, 0);
+
+    if (!pte || !(*pte & PTE_P))
+        return NULL;
+    if (pte_store)
+        *pte_store = pte;
+    return pa2page(PTE_ADDR(*pte));
+}
+
+/*
+ * Unmaps the physical page at virtual address 'va'.
+ * If there is no physical page at that address, silently does nothing.
+ *
+ * Details:
+ *   - The ref count on the physical page should decrement.
+ *   - The physical page should be freed if the refcount reaches 0.
+ *   - The pg table entry corresponding to 'va' should be set to 0.
+ *     (if such a PTE exists)
+ *   - The TLB must be invalidated if you remove an entry from
+ *     the page table.
+ */
+void page_remove(pde_t *pgdir, void *va)
+{
+    struct page_info *pp;
+    pte_t *pte;
+
+    if (!(pp = page_lookup(pgdir, va, &pte)))
+        return;
+    *pte = 0;
+    tlb_invalidate(pgdir, va);
+    page_decref(pp);
+}
+
+/* Flush the batch, and only then drop the references of the pages whose
+ * mappings it removed, so that no stale TLB entry can still reach a page
+ * that has already been handed out again. */
+static void page_remove_commit(struct tlb_batch *tb,
+        struct page_info **pps, int n)
+{
+    tlb_batch_commit(tb);
+    while (n > 0)
+        page_decref(pps[--n]);
+}
+
+/*
+ * Like page_remove, for every page in [va, va+len), with one TLB flush per
+ * TLB_FLUSH_THRESHOLD pages rather than one per page.  va and len must be
+ * page-aligned.
+ */
+void page_remove_range(pde_t *pgdir, void *va, size_t len)
+{
+    struct page_info *pps[TLB_FLUSH_THRESHOLD];
+    struct tlb_batch tb;
+    struct page_info *pp;
+    size_t off;
+    pte_t *pte;
+    int n = 0;
+
+    tlb_batch_begin(&tb, pgdir);
+    for (off = 0; off < len; off += PGSIZE) {
+        if (!(pp = page_lookup(pgdir, (char *) va + off, &pte)))
+            continue;
+        *pte = 0;
+        tlb_batch_add(&tb, (char *) va + off);
+        pps[n++] = pp;
+        if (n == TLB_FLUSH_THRESHOLD) {
+            page_remove_commit(&tb, pps, n);
+            tlb_batch_begin(&tb, pgdir);
+            n = 0;
+        }
+    }
+    page_remove_commit(&tb, pps, n);
+}
+
+/*
+ * Share the pages mapped at [srcva, srcva+len) in srcpgdir copy-on-write
+ * with [dstva, dstva+len) in dstpgdir.  Writable pages lose PTE_W and gain
+ * PTE_COW on both sides; each shared page gains one reference.  No page is
+ * copied until someone writes to it (see page_fault_cow).  Addresses and len
+ * must be page-aligned; unmapped source pages are skipped.
+ *
+ * RETURNS:
+ *   0 on success
+ *   -E_NO_MEM, if a page table couldn't be allocated
+ */
+int page_share_cow(pde_t *dstpgdir, void *dstva, pde_t *srcpgdir, void *srcva,
+        size_t len)
+{
+    struct tlb_batch tb;
+    struct page_info *pp;
+    size_t off;
+    pte_t *pte;
+    int perm, r = 0;
+
+    tlb_batch_begin(&tb, srcpgdir);
+    for (off = 0; off < len; off += PGSIZE) {
+        if (!(pp = page_lookup(srcpgdir, (char *) srcva + off, &pte)))
+            continue;
+        perm = PGOFF(*pte) & ~(PTE_A | PTE_D | PTE_P);
+        if (perm & (PTE_W | PTE_COW)) {
+            perm = (perm & ~PTE_W) | PTE_COW;
+            *pte = page2pa(pp) | perm | PTE_P;
+            tlb_batch_add(&tb, (char *) srcva + off);
+        }
+        if ((r = page_insert(dstpgdir, pp, (char *) dstva + off, perm)) < 0)
+            break;
+    }
+    tlb_batch_commit(&tb);
+    return r;
+}
+
+/*
+ * Resolve a write fault on a PTE_COW page.  The last sharer just gets its
+ * mapping made writable again; anybody else gets a private copy.
+ */
+static int page_fault_cow(pde_t *pgdir, void *va)
+{
+    struct page_info *pp, *np;
+    void *src, *dst;
+    pte_t *pte;
+    int perm;
+
+    va = ROUNDDOWN(va, PGSIZE);
+    if (!(pp = page_lookup(pgdir, va, &pte)) || !(*pte & PTE_COW))
+        return -E_FAULT;
+    perm = (PGOFF(*pte) & ~(PTE_A | PTE_D | PTE_P | PTE_COW)) | PTE_W;
+
+    if (pp->pp_ref == 1) {
+        *pte = page2pa(pp) | perm | PTE_P;
+        tlb_invalidate(pgdir, va);
+        return 0;
+    }
+
+    /* nobody has to read the zero page to know what a copy contains */
+    if (pp == zero_page)
+        np = page_alloc(ALLOC_ZERO);
+    else if ((np = page_alloc(0))) {
+        dst = kmap(np);
+        src = kmap(pp);
+        memcpy(dst, src, PGSIZE);
+        kunmap(src);
+        kunmap(dst);
+    }
+    if (!np)
+        return -E_NO_MEM;
+    return page_insert(pgdir, np, va, perm);
+}
+
+/*
+ * Called by the page fault handler with the faulting 'va' and the fault
+ * error code.  Returns 0 if the fault was one the memory system resolves
+ * (the faulting instruction can simply be restarted), or a negative error
+ * if it is a genuine fault.
+ */
+int page_fault_resolve(pde_t *pgdir, void *va, uint32_t err)
+{
+    if ((err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR))
+        return page_fault_cow(pgdir, va);
+    if (!(err & FEC_PR) && pgdir == kern_pgdir &&
+        (uintptr_t) va >= VMALLOCBASE && (uintptr_t) va < VMALLOCLIM)
+        return vmalloc_fault(va, err);
+    return -E_FAULT;
+}
+
+/*
+ * Invalidate a TLB entry, but only if the page tables being
+ * edited are the ones currently in use by the processor.
+ */
+void tlb_invalidate(pde_t *pgdir, void *va)
+{
+    /* Flush the entry only if we're modifying the current address space.
+     * For now, there is only one address space, so always invalidate. */
+    invlpg(va);
+}
+
+/* Record that [va, va+len) has PTE_G mappings. */
+static void tlb_note_global(uintptr_t va, size_t len)
+{
+    if (!len)
+        return;
+    tlb_global_lo = MIN(tlb_global_lo, va);
+    tlb_global_last = MAX(tlb_global_last, va + len - 1);
+}
+
+static bool tlb_range_global(uintptr_t va, size_t len)
+{
+    return len && va <= tlb_global_last && va + len - 1 >= tlb_global_lo;
+}
+
+/* Flush the entire TLB.  Reloading cr3 keeps PTE_G entries, so if global
+ * pages are enabled and involved, toggle CR4_PGE instead. */
+static void tlb_flush_all(bool global)
+{
+    uint32_t cr4;
+
+    if (global && ((cr4 = rcr4()) & CR4_PGE)) {
+        lcr4(cr4 & ~CR4_PGE);
+        lcr4(cr4);
+    } else
+        tlbflush();
+}
+
+/*
+ * Invalidate the TLB entries for [va, va+len).  Small ranges get one invlpg
+ * per page; past TLB_FLUSH_THRESHOLD pages, refilling the whole TLB is
+ * cheaper than the string of invlpgs.
+ */
+void tlb_invalidate_range(pde_t *pgdir, void *va, size_t len)
+{
+    uintptr_t start = ROUNDDOWN((uintptr_t) va, PGSIZE);
+    uintptr_t end = ROUNDUP((uintptr_t) va + len, PGSIZE);   /* may be 0 */
+    size_t n = (end - start) / PGSIZE;
+    uintptr_t a;
+
+    if (n > TLB_FLUSH_THRESHOLD) {
+        tlb_flush_all(tlb_range_global(start, end - start));
+        return;
+    }
+    for (a = start; n--; a += PGSIZE)
+        tlb_invalidate(pgdir, (void *) a);
+}
+
+void tlb_batch_begin(struct tlb_batch *tb, pde_t *pgdir)
+{
+    tb->tb_pgdir = pgdir;
+    tb->tb_n = 0;
+    tb->tb_full = false;
+    tb->tb_global = false;
+}
+
+/* Queue the invalidation of the page at 'va'. */
+void tlb_batch_add(struct tlb_batch *tb, void *va)
+{
+    uintptr_t a = ROUNDDOWN((uintptr_t) va, PGSIZE);
+
+    if (tlb_range_global(a, PGSIZE))
+        tb->tb_global = true;
+    if (tb->tb_n == TLB_FLUSH_THRESHOLD)
+        tb->tb_full = true;
+    else
+        tb->tb_va[tb->tb_n++] = a;
+}
+
+/* Perform every invalidation queued since tlb_batch_begin. */
+void tlb_batch_commit(struct tlb_batch *tb)
+{
+    int i;
+
+    if (tb->tb_full)
+        tlb_flush_all(tb->tb_global);
+    else
+        for (i = 0; i < tb->tb_n; i++)
+            tlb_invalidate(tb->tb_pgdir, (void *) tb->tb_va[i]);
+    tlb_batch_begin(tb, tb->tb_pgdir);
+}
+
+
+/***************************************************************
+ * Temporary mappings of highmem pages.
+ ***************************************************************/
+
+static void *kmap_slot_va(int cpu, int slot)
+{
+    return (void *) (KMAPBASE + (cpu * KMAP_NSLOTS + slot) * PGSIZE);
+}
+
+/*
+ * Return a kernel virtual address for 'pp' that stays valid until the
+ * matching kunmap.  Lowmem pages simply use the direct map; highmem pages
+ * get a slot in this CPU's kmap window.  Nested kmaps of the same page share
+ * a slot.  Panics if the window is full.
+ */
+void *kmap(struct page_info *pp)
+{
+    struct kmap_slot *slots = kmap_slots[cpunum()];
+    int i, slot = -1;
+
+    if (!page_is_highmem(pp))
+        return KADDR(page2pa(pp));
+
+    for (i = 0; i < KMAP_NSLOTS; i++) {
+        if (slots[i].pp == pp) {
+            slots[i].count++;
+            return kmap_slot_va(cpunum(), i);
+        }
+        if (!slots[i].pp && slot < 0)
+            slot = i;
+    }
+    if (slot < 0)
+        panic("kmap: all %d slots in use", KMAP_NSLOTS);
+
+    slots[slot].pp = pp;
+    slots[slot].count = 1;
+    kmap_ptes[cpunum() * KMAP_NSLOTS + slot] = page2pa(pp) | PTE_W | PTE_P;
+    return kmap_slot_va(cpunum(), slot);
+}
+
+/* Release a kmap.  Direct-map addresses are ignored. */
+void kunmap(void *kva)
+{
+    struct kmap_slot *slots = kmap_slots[cpunum()];
+    int slot = ((uintptr_t) kva - (uintptr_t) kmap_slot_va(cpunum(), 0))
+        / PGSIZE;
+
+    if ((uintptr_t) kva >= KERNBASE)
+        return;
+    if ((uintptr_t) kva < (uintptr_t) kmap_slot_va(cpunum(), 0) ||
+        slot >= KMAP_NSLOTS || !slots[slot].count)
+        panic("kunmap: %08x is not kmap'ed", kva);
+
+    if (--slots[slot].count)
+        return;
+    slots[slot].pp = NULL;
+    kmap_ptes[cpunum() * KMAP_NSLOTS + slot] = 0;
+    invlpg(kmap_slot_va(cpunum(), slot));
+}
+
+/* The current kmap address of highmem page 'pp'; panics if there is none. */
+void *kmap_kva(struct page_info *pp)
+{
+    struct kmap_slot *slots = kmap_slots[cpunum()];
+    int i;
+
+    for (i = 0; i < KMAP_NSLOTS; i++)
+        if (slots[i].pp == pp)
+            return kmap_slot_va(cpunum(), i);
+    panic("page2kva: highmem page %08llx is not kmap'ed",
+        (uint64_t) page2pa(pp));
+}
+
 
 /***************************************************************
  * Checking functions.
@@ -224,11 +1463,11 @@ void page_decref(struct page_info* pp)
 static void check_page_free_list(bool only_low_memory)
 {
     struct page_info *pp;
-    unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
+    physaddr_t pa_limit = only_low_memory ? ENTRYMAPSIZE : ~(physaddr_t) 0;
     int nfree_basemem = 0, nfree_extmem = 0;
     char *first_free_page;
 
-    if (!page_free_list)
+    if (!page_free_list.fs_head)
         panic("'page_free_list' is a null pointer!");
 
     if (only_low_memory) {
@@ -236,27 +1475,28 @@ static void check_page_free_list(bool only_low_memory)
          * entry_pgdir does not map all pages. */
         struct page_info *pp1, *pp2;
         struct page_info **tp[2] = { &pp1, &pp2 };
-        for (pp = page_free_list; pp; pp = pp->pp_link) {
-            int pagetype = PDX(page2pa(pp)) >= pdx_limit;
+        for (pp = page_free_list.fs_head; pp; pp = pp->pp_link) {
+            int pagetype = page2pa(pp) >= pa_limit;
             *tp[pagetype] = pp;
             tp[pagetype] = &pp->pp_link;
         }
         *tp[1] = 0;
         *tp[0] = pp2;
-        page_free_list = pp1;
+        page_free_list.fs_head = pp1;
     }
 
     /* if there's a page that shouldn't be on the free list,
-     * try to make sure it eventually causes trouble. */
-    for (pp = page_free_list; pp; pp = pp->pp_link)
-        if (PDX(page2pa(pp)) < pdx_limit)
+     * try to make sure it eventually causes trouble.  Highmem pages have no
+     * kernel address without a kmap; leave them be. */
+    for (pp = page_free_list.fs_head; pp; pp = pp->pp_link)
+        if (page2pa(pp) < pa_limit && !page_is_highmem(pp))
             memset(page2kva(pp), 0x97, 128);
 
     first_free_page = (char *) boot_alloc(0);
-    for (pp = page_free_list; pp; pp = pp->pp_link) {
+    for (pp = page_free_list.fs_head; pp; pp = pp->pp_link) {
         /* check that we didn't corrupt the free list itself */
         assert(pp >= pages);
-        assert(pp < pages + npages);
+        assert(pp < pages + npage_infos);
         assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
 
         /* check a few pages that shouldn't be on the free list */
@@ -264,7 +1504,8 @@ static void check_page_free_list(bool only_low_memory)
         assert(page2pa(pp) != IOPHYSMEM);
         assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
         assert(page2pa(pp) != EXTPHYSMEM);
-        assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
+        assert(page2pa(pp) < EXTPHYSMEM ||
+               page2pa(pp) >= PADDR(first_free_page));
 
         if (page2pa(pp) < EXTPHYSMEM)
             ++nfree_basemem;
@@ -274,6 +1515,8 @@ static void check_page_free_list(bool only_low_memory)
 
     assert(nfree_basemem > 0);
     assert(nfree_extmem > 0);
+    assert(page_stats->ps_nfree[PZONE_BASE] == nfree_basemem);
+    assert(page_stats->ps_nfree[PZONE_EXT] == nfree_extmem);
 }
 
 /*
@@ -283,16 +1526,19 @@ static void check_page_free_list(bool only_low_memory)
 static void check_page_alloc(void)
 {
     struct page_info *pp, *pp0, *pp1, *pp2;
-    int nfree;
     struct page_info *fl;
+    int nfree;
     char *c;
     int i;
 
     if (!pages)
         panic("'pages' is a null pointer!");
 
+    /* count and steal from the free list alone */
+    page_mag_drain();
+
     /* check number of free pages */
-    for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
+    for (pp = page_free_list.fs_head, nfree = 0; pp; pp = pp->pp_link)
         ++nfree;
 
     /* should be able to allocate three pages */
@@ -304,13 +1550,14 @@ static void check_page_alloc(void)
     assert(pp0);
     assert(pp1 && pp1 != pp0);
     assert(pp2 && pp2 != pp1 && pp2 != pp0);
-    assert(page2pa(pp0) < npages*PGSIZE);
-    assert(page2pa(pp1) < npages*PGSIZE);
-    assert(page2pa(pp2) < npages*PGSIZE);
+    assert(PPN(page2pa(pp0)) < npages);
+    assert(PPN(page2pa(pp1)) < npages);
+    assert(PPN(page2pa(pp2)) < npages);
 
     /* temporarily steal the rest of the free pages */
-    fl = page_free_list;
-    page_free_list = 0;
+    page_mag_drain();
+    fl = page_free_list.fs_head;
+    page_free_list.fs_head = NULL;
 
     /* should be no free memory */
     assert(!page_alloc(0));
@@ -337,8 +1584,10 @@ static void check_page_alloc(void)
     for (i = 0; i < PGSIZE; i++)
         assert(c[i] == 0);
 
-    /* give free list back */
-    page_free_list = fl;
+    /* give free list back; the list is empty again, and its tag has moved
+     * on since we took it, so only the head is restored */
+    assert(!page_free_list.fs_head);
+    page_free_list.fs_head = fl;
 
     /* free the pages we took */
     page_free(pp0);
@@ -346,9 +1595,339 @@ static void check_page_alloc(void)
     page_free(pp2);
 
     /* number of free pages should be the same */
-    for (pp = page_free_list; pp; pp = pp->pp_link)
+    page_mag_drain();
+    for (pp = page_free_list.fs_head; pp; pp = pp->pp_link)
         --nfree;
     assert(nfree == 0);
 
     cprintf("check_page_alloc() succeeded!\n");
 }
+
+/*
+ * Check the lock-free free lists: that the tag defeats ABA, and that the
+ * page_alloc invariants hold while several allocation contexts take turns
+ * at random calling page_alloc and page_free.  This all runs on one CPU, and
+ * each call completes before the next begins, so it only covers orderings
+ * of whole calls; it is not a test of CPUs racing inside a push or pop.
+ */
+#define NSTRESS_CTX     4
+#define NSTRESS_PAGES   16
+#define NSTRESS_STEPS   4096
+
+static void check_page_stack(void)
+{
+    union free_stack st, old, new;
+    struct page_info *pp, *pp0, *pp1;
+    struct page_info *held[NSTRESS_CTX][NSTRESS_PAGES];
+    int nheld[NSTRESS_CTX];
+    uint32_t nfree[NPZONES], seed = 1;
+    int i, j, c, z;
+
+    /* a pop reads head pp1 and next pp0, then loses the race: both pages
+     * are popped and pp1 pushed back.  Its cmpxchg8b must fail. */
+    assert((pp0 = page_alloc(0)));
+    assert((pp1 = page_alloc(0)));
+    st.fs_word = 0;
+    free_stack_push(&st, pp0);
+    free_stack_push(&st, pp1);
+    old = st;
+    new.fs_head = pp1->pp_link;
+    new.fs_tag = old.fs_tag + 1;
+    assert(free_stack_pop(&st) == pp1);
+    assert(free_stack_pop(&st) == pp0);
+    free_stack_push(&st, pp1);
+    assert(st.fs_head == old.fs_head && st.fs_tag != old.fs_tag);
+    assert(!cmpxchg8b(&st.fs_word, &old.fs_word, new.fs_word));
+    assert(old.fs_word == st.fs_word);
+    assert(free_stack_pop(&st) == pp1 && !free_stack_pop(&st));
+    page_free(pp0);
+    page_free(pp1);
+
+    /* interleaved allocation contexts; a held page has pp_ref 1, so a
+     * page handed out twice is caught */
+    for (z = 0; z < NPZONES; z++)
+        nfree[z] = page_stats->ps_nfree[z];
+    for (c = 0; c < NSTRESS_CTX; c++)
+        nheld[c] = 0;
+    for (i = 0; i < NSTRESS_STEPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        c = (seed >> 16) % NSTRESS_CTX;
+        if (!nheld[c] ||
+                (nheld[c] < NSTRESS_PAGES && ((seed >> 8) & 1))) {
+            pp = page_alloc((seed >> 9) & 1 ? ALLOC_HIGHMEM : 0);
+            assert(pp);
+            assert(!pp->pp_ref && !pp->pp_link);
+            assert(!(pp->pp_flags & PP_FREE));
+            assert(PPN(page2pa(pp)) < npages);
+            pp->pp_ref = 1;
+            held[c][nheld[c]++] = pp;
+        } else {
+            j = (seed >> 4) % nheld[c];
+            pp = held[c][j];
+            held[c][j] = held[c][--nheld[c]];
+            pp->pp_ref = 0;
+            page_free(pp);
+        }
+    }
+    for (c = 0; c < NSTRESS_CTX; c++)
+        while (nheld[c]) {
+            pp = held[c][--nheld[c]];
+            pp->pp_ref = 0;
+            page_free(pp);
+        }
+    for (z = 0; z < NPZONES; z++)
+        assert(page_stats->ps_nfree[z] == nfree[z]);
+
+    cprintf("check_page_stack() succeeded!\n");
+}
+
+/*
+ * Check that the section metadata round-trips and that holes were skipped.
+ */
+static void check_page_sections(void)
+{
+    struct page_info *pp;
+
+    for (pp = pages; pp < pages + npage_infos; pp++) {
+        assert(PGSECT(page2pa(pp)) < nsections);
+        assert(page_sections[PGSECT(page2pa(pp))]);
+        if (PPN(page2pa(pp)) < npages)
+            assert(pa2page(page2pa(pp)) == pp);
+    }
+
+    /* the VGA part of the IO hole never holds RAM */
+    assert(!page_sections[PGSECT(IOPHYSMEM)]);
+    assert(page_sections[PGSECT(EXTPHYSMEM)]);
+    assert(npage_infos <= nsections * NPGPERSECT);
+
+    cprintf("check_page_sections() succeeded!\n");
+}
+
+/* The physical address 'va' maps to in the current address space, or ~0 if
+ * it is unmapped.  Unlike pte_lookup, this follows large pages. */
+static physaddr_t check_va2pa(uintptr_t va)
+{
+    pde_t pde = uvpd[PDX(va)];
+
+    if (!(pde & PTE_P))
+        return ~(physaddr_t) 0;
+    if (pde & PTE_PS)
+        return PTE_ADDR(pde) + (va & (PTSIZE - 1));
+    if (!(uvpt[PGNUM(va)] & PTE_P))
+        return ~(physaddr_t) 0;
+    return PTE_ADDR(uvpt[PGNUM(va)]) + PGOFF(va);
+}
+
+/*
+ * Check the kernel part of kern_pgdir, now that it is loaded, and that the
+ * UVPT self-map agrees with pgdir_walk.
+ */
+static void check_kern_pgdir(void)
+{
+    struct page_info *pp, *ptp;
+    pte_t *pte;
+    uint32_t i;
+    void *va = (void *) PTSIZE;
+
+    /* the kernel stack and physical memory are mapped */
+    for (i = 0; i < KSTKSIZE; i += PGSIZE)
+        assert(PTE_ADDR(pte_lookup((void *) (KSTACKTOP - KSTKSIZE + i)))
+                == PADDR(bootstack) + i);
+    assert(!(pte_lookup((void *) (KSTACKTOP - KSTKSIZE - PGSIZE)) & PTE_P));
+    for (i = 0; i < npages_lowmem * PGSIZE; i += PGSIZE)
+        assert(check_va2pa(KERNBASE + i) == i);
+    for (i = IOPHYSMEM; i < EXTPHYSMEM; i += PGSIZE)
+        assert((pte_lookup(KADDR(i)) & (PTE_PCD | PTE_PWT))
+                == (PTE_PCD | PTE_PWT));
+
+    /* pages and the statistics page are exported read-only */
+    for (i = 0; i < npage_infos * sizeof(struct page_info); i += PGSIZE)
+        assert(PTE_ADDR(pte_lookup((void *) (UPAGES + i)))
+                == PADDR(pages) + i);
+    assert((pte_lookup((void *) UPAGESTATS) & (PTE_U | PTE_W)) == PTE_U);
+    assert(((struct page_stats *) UPAGESTATS)->ps_version
+            == PAGE_STATS_VERSION);
+
+    /* the directory maps itself, read-only to the user */
+    for (i = 0; i < UVPTSIZE / PTSIZE; i++)
+        assert(uvpd[PDX(UVPT) + i] ==
+                ((PADDR(kern_pgdir) + i * PGSIZE) | PTE_U | PTE_P));
+    assert(uvpd[PDX(KERNBASE)] == kern_pgdir[PDX(KERNBASE)]);
+    assert(!(pte_lookup(va) & PTE_P));
+
+    /* a fresh mapping shows up through both views */
+    assert((pp = page_alloc(ALLOC_ZERO)));
+    assert(page_insert(kern_pgdir, pp, va, PTE_W) == 0);
+    assert(pp->pp_ref == 1);
+    assert(page_lookup(kern_pgdir, va, &pte) == pp);
+    assert(*pte == pte_lookup(va));
+    assert(PTE_ADDR(pte_lookup(va)) == page2pa(pp));
+    page_remove(kern_pgdir, va);
+    assert(!(pte_lookup(va) & PTE_P));
+
+    /* batched removal drops every page in the range */
+    assert(page_alloc(0) == pp);
+    assert(page_insert(kern_pgdir, pp, va, PTE_W) == 0);
+    assert(page_insert(kern_pgdir, pp, (char *) va + 2 * PGSIZE, PTE_W) == 0);
+    assert(pp->pp_ref == 2);
+    page_remove_range(kern_pgdir, va, 3 * PGSIZE);
+    assert(!(pte_lookup(va) & PTE_P));
+    assert(!(pte_lookup((char *) va + 2 * PGSIZE) & PTE_P));
+    assert(pp->pp_ref == 0);
+    assert(page_alloc(0) == pp);
+
+    /* releasing a page table that is also hooked in elsewhere only drops
+     * that reference, and leaves its entries alone */
+    ptp = pa2page(PTE_ADDR(kern_pgdir[PDX(va)]));
+    assert(page_insert(kern_pgdir, pp, va, PTE_W) == 0);
+    kern_pgdir[PDX((char *) va + 2 * PTSIZE)] = kern_pgdir[PDX(va)];
+    ptp->pp_ref++;
+    pgdir_free_pt(kern_pgdir, (char *) va + 2 * PTSIZE);
+    assert(!kern_pgdir[PDX((char *) va + 2 * PTSIZE)]);
+    assert(ptp->pp_ref == 1 && pp->pp_ref == 1);
+    assert(PTE_ADDR(pte_lookup(va)) == page2pa(pp));
+    page_remove(kern_pgdir, va);
+    assert(page_alloc(0) == pp);
+
+    /* releasing a page table unmaps what is left in it, and the next table
+     * built reuses it, zeroed */
+    assert(page_insert(kern_pgdir, pp, va, PTE_W) == 0);
+    pgdir_free_pt(kern_pgdir, va);
+    assert(!kern_pgdir[PDX(va)] && !pte_lookup(va));
+    assert(pp->pp_ref == 0 && page_alloc(0) == pp);
+    assert(page_insert(kern_pgdir, pp, (char *) va + PTSIZE, PTE_W) == 0);
+    assert(PTE_ADDR(kern_pgdir[PDX((char *) va + PTSIZE)]) == page2pa(ptp));
+    pte = page2kva(ptp);
+    for (i = 1; i < NPTENTRIES; i++)
+        assert(!pte[i]);
+    pgdir_free_pt(kern_pgdir, (char *) va + PTSIZE);
+    assert(pp->pp_ref == 0);
+
+    cprintf("check_kern_pgdir() succeeded!\n");
+}
+
+/*
+ * Check copy-on-write sharing and its write-fault path.
+ */
+static void check_page_cow(void)
+{
+    struct page_info *pp, *pp1;
+    char *va0 = (char *) PTSIZE, *va1 = va0 + PGSIZE;
+    pte_t *pte;
+
+    assert((pp = page_alloc(0)));
+    assert(page_insert(kern_pgdir, pp, va0, PTE_W) == 0);
+    memset(va0, 0x55, PGSIZE);
+
+    /* sharing maps the same page twice, read-only */
+    assert(page_share_cow(kern_pgdir, va1, kern_pgdir, va0, PGSIZE) == 0);
+    assert(pp->pp_ref == 2);
+    assert(page_lookup(kern_pgdir, va1, &pte) == pp);
+    assert((*pte & (PTE_W | PTE_COW)) == PTE_COW);
+    assert((pte_lookup(va0) & (PTE_W | PTE_COW)) == PTE_COW);
+    assert(va1[17] == 0x55);
+
+    /* a write fault by one sharer copies the page */
+    assert(page_fault_resolve(kern_pgdir, va1, FEC_PR | FEC_WR) == 0);
+    assert((pp1 = page_lookup(kern_pgdir, va1, &pte)) && pp1 != pp);
+    assert((*pte & (PTE_W | PTE_COW)) == PTE_W);
+    assert(pp->pp_ref == 1 && pp1->pp_ref == 1);
+    va1[17] = 0x66;
+    assert(va0[17] == 0x55 && va1[18] == 0x55);
+
+    /* ... and the last sharer just gets write access back */
+    assert(page_fault_resolve(kern_pgdir, va0, FEC_PR | FEC_WR) == 0);
+    assert(page_lookup(kern_pgdir, va0, &pte) == pp);
+    assert((*pte & (PTE_W | PTE_COW)) == PTE_W);
+
+    /* other faults are not ours to resolve */
+    assert(page_fault_resolve(kern_pgdir, va0 + 2 * PGSIZE, FEC_WR) < 0);
+
+    page_remove_range(kern_pgdir, va0, 2 * PGSIZE);
+    pgdir_free_pt(kern_pgdir, va0);
+
+    cprintf("check_page_cow() succeeded!\n");
+}
+
+/*
+ * Check that compaction moves movable pages up and leaves pinned ones.
+ */
+static void check_page_compact(void)
+{
+    struct page_info *pp0, *pp1, *pp;
+    char *va = (char *) PTSIZE;
+    size_t maxrun, nsuper, maxrun1, nsuper1;
+    physaddr_t pa0;
+
+    /* compacting sorts the free list, so the next page is the lowest */
+    page_compact(kern_pgdir);
+    page_free_runs(&maxrun, &nsuper);
+    assert(maxrun > 0);
+
+    assert((pp0 = page_alloc(ALLOC_MOVABLE)));
+    assert((pp1 = page_alloc(0)));
+    assert(pp0->pp_flags == PP_MOVABLE && pp1->pp_flags == 0);
+    pa0 = page2pa(pp0);
+    assert(page_insert(kern_pgdir, pp0, va, PTE_W) == 0);
+    assert(page_insert(kern_pgdir, pp1, va + PGSIZE, PTE_W) == 0);
+    memset(va, 0x3c, PGSIZE);
+
+    /* the movable page moves up, keeps its contents, and frees its frame */
+    assert(page_compact(kern_pgdir) == 1);
+    assert((pp = page_lookup(kern_pgdir, va, NULL)) && pp != pp0);
+    assert(page2pa(pp) > pa0);
+    assert(pp->pp_ref == 1 && pp->pp_flags == PP_MOVABLE);
+    assert(pp0->pp_ref == 0 && pp0->pp_flags == PP_FREE);
+    assert(va[0] == 0x3c && va[PGSIZE - 1] == 0x3c);
+    assert(page_lookup(kern_pgdir, va + PGSIZE, NULL) == pp1);
+    assert(page_alloc(0) == pp0);
+    page_free(pp0);
+
+    /* pinned pages stay where they are */
+    page_pin(pp);
+    assert(page_compact(kern_pgdir) == 0);
+    assert(page_lookup(kern_pgdir, va, NULL) == pp);
+
+    page_remove_range(kern_pgdir, va, 2 * PGSIZE);
+    pgdir_free_pt(kern_pgdir, va);
+
+    page_compact(kern_pgdir);
+    page_free_runs(&maxrun1, &nsuper1);
+    assert(maxrun1 >= maxrun && nsuper1 >= nsuper);
+
+    cprintf("check_page_compact() succeeded!\n");
+}
+
+/*
+ * Check kmap on lowmem and (if the machine has any) highmem pages.
+ */
+static void check_kmap(void)
+{
+    struct page_info *pp;
+    char *kva;
+
+    /* lowmem pages just use the direct map */
+    assert((pp = page_alloc(0)));
+    assert(kmap(pp) == page2kva(pp));
+    kunmap(page2kva(pp));
+    page_free(pp);
+
+    assert((pp = page_alloc(ALLOC_HIGHMEM | ALLOC_ZERO)));
+    if (page_is_highmem(pp)) {
+        kva = kmap(pp);
+        assert((uintptr_t) kva >= KMAPBASE && (uintptr_t) kva < KMAPLIM);
+        assert(page2kva(pp) == kva);
+        assert(PTE_ADDR(pte_lookup(kva)) == page2pa(pp));
+        assert(kva[0] == 0 && kva[PGSIZE - 1] == 0);
+
+        /* nested kmaps share the slot until the last kunmap */
+        assert(kmap(pp) == kva);
+        kunmap(kva);
+        assert(pte_lookup(kva) & PTE_P);
+        kunmap(kva);
+        assert(!(pte_lookup(kva) & PTE_P));
+    }
+    page_free(pp);
+
+    cprintf("check_kmap() succeeded!\n");
+}
@@ -11,9 +11,47 @@
 
 extern char bootstacktop[], bootstack[];
 
+extern pde_t *kern_pgdir;
+#ifdef JOS_PAE
+extern uint64_t kern_pdpt[NPDPENTRIES];
+#endif
+
 extern struct page_info *pages;
 extern size_t npages;
 
+/* Pages [0, npages_lowmem) are mapped at KERNBASE; any above that are
+ * "highmem" and have to be kmap'ed before the kernel can touch them. */
+#define NPAGES_DIRECT   ((size_t) (0 - KERNBASE) / PGSIZE)
+extern size_t npages_lowmem;
+
+/* Page metadata is kept per section of physical memory.  Only sections that
+ * contain usable RAM get a chunk of 'struct page_info's; page_sections[s] is
+ * NULL for sections that lie entirely in a hole.  All present chunks are
+ * allocated back to back starting at 'pages', 'npage_infos' entries in all,
+ * and page_chunk_sect[c] is the section of the c'th chunk, which is how
+ * page2pa() gets from an entry back to its physical address. */
+#define PGSECTSHIFT 17                              /* 128KB sections */
+#define NPGPERSECT  (1 << (PGSECTSHIFT - PGSHIFT))  /* pages per section */
+#define PGSECT(pa)  (((physaddr_t) (pa)) >> PGSECTSHIFT)
+
+extern struct page_info **page_sections;
+extern uint32_t *page_chunk_sect;
+extern size_t nsections;
+extern size_t npage_infos;
+
+extern volatile struct page_stats *page_stats;
+
+/* The CPU we are running on.  There is only CPU 0 until the kernel learns
+ * about SMP. */
+static inline int cpunum(void)
+{
+    return 0;
+}
+
+/* A page of zeroes, mapped read-only and copy-on-write wherever a page only
+ * has to read as zero.  The kernel holds one reference to it for good. */
+extern struct page_info *zero_page;
+
 
 /* This macro takes a kernel virtual address -- an address that points above
  * KERNBASE, where the machine's maximum 256MB of physical memory is mapped --
@@ -26,24 +64,59 @@ static inline physaddr_t _paddr(const char *file, int line, void *kva)
 {
     if ((uint32_t)kva < KERNBASE)
         _panic(file, line, "PADDR called with invalid kva %08lx", kva);
-    return (physaddr_t)kva - KERNBASE;
+    return (physaddr_t) ((uintptr_t) kva - KERNBASE);
 }
 
 /* This macro takes a physical address and returns the corresponding kernel
- * virtual address.  It panics if you pass an invalid physical address. */
+ * virtual address.  It panics if you pass an invalid physical address, or one
+ * beyond the direct map (use kmap for those). */
 #define KADDR(pa) _kaddr(__FILE__, __LINE__, pa)
 
 static inline void *_kaddr(const char *file, int line, physaddr_t pa)
 {
-    if (PGNUM(pa) >= npages)
-        _panic(file, line, "KADDR called with invalid pa %08lx", pa);
-    return (void *)(pa + KERNBASE);
+    if (PPN(pa) >= npages_lowmem)
+        _panic(file, line, "KADDR called with invalid pa %08llx",
+            (uint64_t) pa);
+    return (void *) (uintptr_t) (pa + KERNBASE);
 }
 
 
 enum {
     /* For page_alloc, zero the returned physical page. */
     ALLOC_ZERO = 1<<0,
+    /* The page will only be referenced from page table entries, so
+     * page_compact may move it elsewhere. */
+    ALLOC_MOVABLE = 1<<1,
+    /* The caller copes with a page beyond the direct map (see kmap), so
+     * page_alloc may hand out highmem, and prefers to. */
+    ALLOC_HIGHMEM = 1<<2,
+};
+
+/* Memory types for mmio_map_region.  pat_init sets up the page attribute
+ * table so that each one is selected by PTE_PWT and PTE_PCD alone, which
+ * mean the same in page table entries and large-page directory entries. */
+enum {
+    MEMTYPE_WB,     /* write-back, like ordinary memory */
+    MEMTYPE_WC,     /* write-combining, for frame buffers */
+    MEMTYPE_UC,     /* uncached, for device registers */
+};
+
+/* Above this many pages, a range invalidation flushes the whole TLB instead
+ * of issuing one invlpg per page. */
+#define TLB_FLUSH_THRESHOLD 32
+
+/*
+ * A batch of pending TLB invalidations.  Unmap and remap loops add each
+ * va they change and flush once with tlb_batch_commit().  Once more than
+ * TLB_FLUSH_THRESHOLD pages are queued the batch just remembers that a full
+ * flush is due.
+ */
+struct tlb_batch {
+    pde_t *tb_pgdir;
+    uintptr_t tb_va[TLB_FLUSH_THRESHOLD];
+    int tb_n;
+    bool tb_full;       /* too many pages queued: flush everything */
+    bool tb_global;     /* a queued page may have a PTE_G mapping */
 };
 
 void mem_init(void);
@@ -52,22 +125,70 @@ void page_init(void);
 struct page_info *page_alloc(int alloc_flags);
 void page_free(struct page_info *pp);
 void page_decref(struct page_info *pp);
+int page_alloc_bench(int nrounds, uint64_t *cycles);
+void page_pin(struct page_info *pp);
+int page_compact(pde_t *pgdir);
+void page_free_runs(size_t *maxrun, size_t *nsuper);
+
+int page_insert(pde_t *pgdir, struct page_info *pp, void *va, int perm);
+void page_remove(pde_t *pgdir, void *va);
+struct page_info *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
+void page_remove_range(pde_t *pgdir, void *va, size_t len);
+int page_share_cow(pde_t *dstpgdir, void *dstva, pde_t *srcpgdir, void *srcva,
+        size_t len);
+int page_fault_resolve(pde_t *pgdir, void *va, uint32_t err);
+void tlb_invalidate(pde_t *pgdir, void *va);
+void tlb_invalidate_range(pde_t *pgdir, void *va, size_t len);
+void tlb_batch_begin(struct tlb_batch *tb, pde_t *pgdir);
+void tlb_batch_add(struct tlb_batch *tb, void *va);
+void tlb_batch_commit(struct tlb_batch *tb);
+pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
+void *mmio_map_region(physaddr_t pa, size_t size, int memtype);
+void pgdir_free_pt(pde_t *pgdir, void *va);
 
 static inline physaddr_t page2pa(struct page_info *pp)
 {
-    return (pp - pages) << PGSHIFT;
+    size_t i = pp - pages;
+
+    return ((physaddr_t) page_chunk_sect[i / NPGPERSECT] << PGSECTSHIFT) |
+        ((i % NPGPERSECT) << PGSHIFT);
 }
 
 static inline struct page_info *pa2page(physaddr_t pa)
 {
-    if (PGNUM(pa) >= npages)
+    if (PPN(pa) >= npages || !page_sections[PGSECT(pa)])
         panic("pa2page called with invalid pa");
-    return &pages[PGNUM(pa)];
+    return &page_sections[PGSECT(pa)][PPN(pa) & (NPGPERSECT - 1)];
+}
+
+void *kmap(struct page_info *pp);
+void kunmap(void *kva);
+void *kmap_kva(struct page_info *pp);
+
+static inline bool page_is_highmem(struct page_info *pp)
+{
+    return PPN(page2pa(pp)) >= npages_lowmem;
 }
 
+/* The kernel virtual address of 'pp'.  For a highmem page that is only its
+ * current kmap slot; page2kva panics if it is not kmap'ed. */
 static inline void *page2kva(struct page_info *pp)
 {
+    if (page_is_highmem(pp))
+        return kmap_kva(pp);
     return KADDR(page2pa(pp));
 }
 
+/* Return the PTE mapping 'va' in the current address space, or 0 if there is
+ * no page table for it (or it lies in a large page).  Because every page
+ * directory maps itself at UVPT, this takes two loads, the PDE through uvpd
+ * and then the PTE through uvpt, with no pointer chasing through KADDR; the
+ * second load depends on the first only through the branch. */
+static inline pte_t pte_lookup(const void *va)
+{
+    if ((uvpd[PDX(va)] & (PTE_P | PTE_PS)) != PTE_P)
+        return 0;
+    return uvpt[PGNUM(va)];
+}
+
 #endif /* !JOS_KERN_PMAP_H */
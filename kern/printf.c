@@ -1,25 +1,57 @@
 /*
  * Simple implementation of cprintf console output for the kernel, based on
- * printfmt() and the kernel console's cputchar().
+ * printfmt().  Output goes to the kernel log, which passes it on to the
+ * console's cons_write().
  */
 
 #include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/klog.h>
 
-static void putch(int ch, int *cnt)
+/* Output is collected here and handed to the log a chunk at a time, so
+ * each device sees one write per chunk rather than one per character. */
+#define PRINTBUF_SIZE 128
+
+struct printbuf {
+    int level;  /* KLOG_* level from the format, or -1 */
+    int idx;    /* current buffer index */
+    int cnt;    /* total bytes printed so far */
+    char buf[PRINTBUF_SIZE];
+};
+
+
+static void putch(int ch, struct printbuf *b)
+{
+    b->buf[b->idx++] = ch;
+    if (b->idx == PRINTBUF_SIZE) {
+        klog_write(b->level, b->buf, b->idx);
+        b->idx = 0;
+    }
+    b->cnt++;
+}
+
+/* Like vcprintf, but log the lines this output starts at 'level' (-1 for
+ * the default) rather than at any level fmt gives. */
+int vcprintf_level(int level, const char *fmt, va_list ap)
 {
-    cputchar(ch);
-    *cnt++;
+    struct printbuf b;
+
+    b.level = level;
+    b.idx = 0;
+    b.cnt = 0;
+    vprintfmt((void*)putch, &b, fmt, ap);
+    klog_write(b.level, b.buf, b.idx);
+
+    return b.cnt;
 }
 
 int vcprintf(const char *fmt, va_list ap)
 {
-    int cnt = 0;
+    int level = klog_level(&fmt);
 
-    vprintfmt((void*)putch, &cnt, fmt, ap);
-    return cnt;
+    return vcprintf_level(level, fmt, ap);
 }
 
 int cprintf(const char *fmt, ...)
@@ -33,4 +65,3 @@ int cprintf(const char *fmt, ...)
 
     return cnt;
 }
-
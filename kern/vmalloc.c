@@ -0,0 +1,205 @@
+/* See COPYRIGHT for copyright information. */
+
+/*
+ * Virtually contiguous kernel allocations.  vmalloc() backs a contiguous
+ * range of [VMALLOCBASE, VMALLOCLIM) with whatever physical pages
+ * page_alloc hands out, so large tables and buffers do not need physically
+ * contiguous memory.  Every allocation is followed by an unmapped guard page
+ * that catches overruns.
+ *
+ * The pages are allocated ALLOC_MOVABLE: nothing but their PTE refers to
+ * them, so page_compact is free to migrate them.  For the same reason they
+ * may come from highmem.
+ *
+ * vmalloc_lazy() allocations are demand-zero: no page is mapped until the
+ * first touch faults.  A read maps the shared zero_page copy-on-write, a
+ * write maps a freshly zeroed page, so sparse tables only pay for the parts
+ * that are actually used.
+ */
+
+#include <inc/x86.h>
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/pmap.h>
+#include <kern/vmalloc.h>
+#include <kern/ktrace.h>
+
+/* State of each page of the vmalloc area. */
+enum {
+    VM_FREE = 0,
+    VM_HEAD,        /* first page of an allocation */
+    VM_BODY,        /* later page of an allocation */
+    VM_GUARD,       /* guard page after an allocation */
+    VM_LAZY = 0x80, /* flag on HEAD and BODY: populated on first touch */
+};
+
+static uint8_t vm_state[NVMPAGES];
+
+static void check_vmalloc(void);
+
+void vmalloc_init(void)
+{
+    check_vmalloc();
+}
+
+/* Reserve 'npg' pages of the vmalloc area plus a guard page, first fit.
+ * Returns the first page's va, or NULL if there is no room. */
+static char *vm_reserve(size_t npg, int lazy)
+{
+    size_t i, run = 0;
+
+    if (npg == 0)
+        return NULL;
+    for (i = 0; i < NVMPAGES && run < npg + 1; i++)
+        run = vm_state[i] == VM_FREE ? run + 1 : 0;
+    if (run < npg + 1)
+        return NULL;
+    i -= run;
+
+    vm_state[i] = VM_HEAD | lazy;
+    memset(&vm_state[i + 1], VM_BODY | lazy, npg - 1);
+    vm_state[i + npg] = VM_GUARD;
+    return (char *) VMALLOCBASE + i * PGSIZE;
+}
+
+/*
+ * Allocate 'len' bytes of kernel virtual memory backed by (not necessarily
+ * contiguous) physical pages.  The memory is not zeroed.
+ * Returns NULL if there is not enough virtual or physical memory.
+ */
+void *vmalloc(size_t len)
+{
+    size_t npg = ROUNDUP(len, PGSIZE) / PGSIZE;
+    struct page_info *pp;
+    size_t run;
+    char *va;
+
+    if (!(va = vm_reserve(npg, 0)))
+        return NULL;
+
+    for (run = 0; run < npg; run++) {
+        if (!(pp = page_alloc(ALLOC_MOVABLE | ALLOC_HIGHMEM)) ||
+            page_insert(kern_pgdir, pp, va + run * PGSIZE, PTE_W) < 0) {
+            if (pp)
+                page_free(pp);
+            vfree(va);
+            return NULL;
+        }
+    }
+    return va;
+}
+
+/*
+ * Reserve 'len' bytes of kernel virtual memory that read as zero and are
+ * populated a page at a time as they are touched.  Returns NULL if there is
+ * no room in the vmalloc area.
+ */
+void *vmalloc_lazy(size_t len)
+{
+    return vm_reserve(ROUNDUP(len, PGSIZE) / PGSIZE, VM_LAZY);
+}
+
+/*
+ * Resolve a not-present fault at 'va' in the vmalloc area, given the fault
+ * error code.  Called by page_fault_resolve.  Returns 0 if 'va' is in a
+ * vmalloc_lazy region and is now mapped, <0 otherwise.
+ */
+int vmalloc_fault(void *va, uint32_t err)
+{
+    size_t i = ((uintptr_t) va - VMALLOCBASE) / PGSIZE;
+    struct page_info *pp;
+    int r;
+
+    if (i >= NVMPAGES || !(vm_state[i] & VM_LAZY))
+        return -E_FAULT;
+    va = ROUNDDOWN(va, PGSIZE);
+    ktrace("vmalloc_fault va %08x err %x", va, err);
+
+    /* reads share the zero page until somebody writes (page_fault_cow) */
+    if (!(err & FEC_WR) && zero_page->pp_ref < 0xFFFF)
+        return page_insert(kern_pgdir, zero_page, va, PTE_COW);
+
+    if (!(pp = page_alloc(ALLOC_ZERO | ALLOC_MOVABLE | ALLOC_HIGHMEM)))
+        return -E_NO_MEM;
+    if ((r = page_insert(kern_pgdir, pp, va, PTE_W)) < 0)
+        page_free(pp);
+    return r;
+}
+
+/* Free memory returned by vmalloc.  vfree(NULL) does nothing. */
+void vfree(void *va)
+{
+    size_t i, n;
+
+    if (!va)
+        return;
+    i = ((uintptr_t) va - VMALLOCBASE) / PGSIZE;
+    if ((uintptr_t) va < VMALLOCBASE || i >= NVMPAGES ||
+        PGOFF(va) || (vm_state[i] & ~VM_LAZY) != VM_HEAD)
+        panic("vfree: %08x was not returned by vmalloc", va);
+
+    for (n = 1; vm_state[i + n] != VM_GUARD; n++)
+        ;
+    n++;
+    page_remove_range(kern_pgdir, va, n * PGSIZE);
+    memset(&vm_state[i], VM_FREE, n);
+}
+
+
+/*
+ * Check vmalloc'ed memory is contiguous, guarded, and given back by vfree.
+ */
+static void check_vmalloc(void)
+{
+    char *a, *b, *c;
+    size_t i;
+
+    assert(!vmalloc(0));
+    assert(!vmalloc(NVMPAGES * PGSIZE));
+
+    assert((a = vmalloc(3 * PGSIZE + 1)));
+    assert((b = vmalloc(PGSIZE)));
+    assert(a == (char *) VMALLOCBASE);
+    assert(b == a + 5 * PGSIZE);
+
+    /* the pages are mapped and usable, the guard page is not */
+    for (i = 0; i < 4; i++)
+        assert(pte_lookup(a + i * PGSIZE) & PTE_W);
+    assert(!(pte_lookup(a + 4 * PGSIZE) & PTE_P));
+    memset(a, 0x5a, 4 * PGSIZE);
+    assert(PTE_ADDR(pte_lookup(a)) != PTE_ADDR(pte_lookup(a + PGSIZE)));
+
+    /* freed space is reused first-fit */
+    vfree(a);
+    assert(!(pte_lookup(a) & PTE_P));
+    assert((c = vmalloc(2 * PGSIZE)) == a);
+    vfree(c);
+    vfree(b);
+
+    /* lazy regions start out empty and fill in on faults */
+    assert((a = vmalloc_lazy(3 * PGSIZE)) == (char *) VMALLOCBASE);
+    for (i = 0; i < 4; i++)
+        assert(!(pte_lookup(a + i * PGSIZE) & PTE_P));
+    assert(vmalloc_fault(a, 0) == 0);
+    assert(PTE_ADDR(pte_lookup(a)) == page2pa(zero_page));
+    assert((pte_lookup(a) & (PTE_W | PTE_COW)) == PTE_COW);
+    assert(a[100] == 0);
+    assert(zero_page->pp_ref == 2);
+    assert(page_fault_resolve(kern_pgdir, a + PGSIZE, FEC_WR) == 0);
+    assert(PTE_ADDR(pte_lookup(a + PGSIZE)) != page2pa(zero_page));
+    a[PGSIZE] = 1;
+    assert(page_fault_resolve(kern_pgdir, a, FEC_PR | FEC_WR) == 0);
+    assert(PTE_ADDR(pte_lookup(a)) != page2pa(zero_page));
+    a[0] = 1;
+    assert(zero_page->pp_ref == 1);
+    assert(vmalloc_fault(a + 3 * PGSIZE, FEC_WR) < 0);
+    vfree(a);
+    assert(!(pte_lookup(a) & PTE_P));
+
+    for (i = 0; i < NVMPAGES; i++)
+        assert(vm_state[i] == VM_FREE);
+
+    cprintf("check_vmalloc() succeeded!\n");
+}
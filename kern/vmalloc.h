@@ -0,0 +1,19 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_VMALLOC_H
+#define JOS_KERN_VMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/memlayout.h>
+
+#define NVMPAGES    ((VMALLOCLIM - VMALLOCBASE) / PGSIZE)
+
+void vmalloc_init(void);
+void *vmalloc(size_t len);
+void *vmalloc_lazy(size_t len);
+void vfree(void *va);
+int vmalloc_fault(void *va, uint32_t err);
+
+#endif /* !JOS_KERN_VMALLOC_H */
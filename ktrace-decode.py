@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+
+"""Decode a dump of the kernel's ktrace rings (see kern/ktrace.h).
+
+Get the dump from a running kernel with the QEMU monitor command that
+
+    ./ktrace-decode.py --memsave
+
+prints (it looks ktrace_bufs up in obj/kern/kernel.sym), then run
+
+    ./ktrace-decode.py ktrace.bin
+
+Events from all CPUs are merged by TSC.  Format strings and %s arguments
+are read out of the kernel image, which must be the one that was running.
+"""
+
+from __future__ import print_function
+
+import re
+import struct
+import sys
+from optparse import OptionParser
+
+# Must match kern/ktrace.h and NCPU in inc/memlayout.h
+NCPU = 8
+KTRACE_NARGS = 6
+KTRACE_NENTS = 512
+ENT = struct.Struct("<QI%dI" % KTRACE_NARGS)
+BUFSIZE = 4 + KTRACE_NENTS * ENT.size
+
+
+def read_sym(symfile, name):
+    for line in open(symfile):
+        fields = line.split()
+        if len(fields) == 3 and fields[2] == name:
+            return int(fields[0], 16)
+    sys.exit("%s: no symbol %s" % (symfile, name))
+
+
+class Image(object):
+    """The loadable segments of an ELF32 kernel, addressed by vaddr."""
+
+    def __init__(self, path):
+        data = open(path, "rb").read()
+        if data[:4] != b"\x7fELF":
+            sys.exit("%s: not an ELF file" % path)
+        phoff, = struct.unpack_from("<I", data, 28)
+        phentsize, phnum = struct.unpack_from("<HH", data, 42)
+        self.segs = []
+        for i in range(phnum):
+            (ptype, off, vaddr, paddr, filesz, memsz,
+             flags, align) = struct.unpack_from("<8I", data,
+                                                phoff + i * phentsize)
+            if ptype == 1:
+                self.segs.append((vaddr, data[off:off + filesz]))
+
+    def string(self, addr):
+        for vaddr, seg in self.segs:
+            if vaddr <= addr < vaddr + len(seg):
+                off = addr - vaddr
+                end = seg.find(b"\0", off)
+                return seg[off:end if end >= 0 else len(seg)].decode(
+                    "latin-1")
+        return "<%08x?>" % addr
+
+
+CONV = re.compile(r"%([-0 #+]*)(\d*)(?:\.(\d+))?(l{0,2})([diouxXcspe%])")
+
+
+def cformat(image, fmt, args):
+    """Format like the kernel's vprintfmt, for the conversions it has."""
+    args = list(args)
+
+    def arg():
+        return args.pop(0) if args else 0
+
+    def conv(m):
+        flags, width, prec, length, c = m.groups()
+        if c == "%":
+            return "%"
+        if c in "di":
+            v = arg() | (arg() << 32) if length == "ll" else arg()
+            bits = 64 if length == "ll" else 32
+            if v >= 1 << (bits - 1):
+                v -= 1 << bits
+            spec = "d"
+        elif c in "ouxX":
+            v = arg() | (arg() << 32) if length == "ll" else arg()
+            spec = {"u": "d"}.get(c, c)
+        elif c == "p":
+            return "0x%08x" % arg()
+        elif c == "c":
+            v, spec = chr(arg() & 0xff), "s"
+        elif c == "s":
+            v, spec = image.string(arg()), "s"
+            if prec:
+                v = v[:int(prec)]
+        else:
+            v, spec = "error %d" % arg(), "s"
+        return ("%" + flags + width + spec) % v
+
+    return CONV.sub(conv, fmt)
+
+
+def main():
+    parser = OptionParser(usage="usage: %prog [options] [ktrace.bin]")
+    parser.add_option("-k", "--kernel", default="obj/kern/kernel",
+                      help="kernel image [default: %default]")
+    parser.add_option("--memsave", action="store_true",
+                      help="print the QEMU monitor command to dump the rings")
+    opts, args = parser.parse_args()
+
+    addr = read_sym(opts.kernel + ".sym", "ktrace_bufs")
+    if opts.memsave:
+        print("memsave 0x%08x %d ktrace.bin" % (addr, NCPU * BUFSIZE))
+        return
+    if len(args) != 1:
+        parser.error("need a dump file")
+
+    image = Image(opts.kernel)
+    dump = open(args[0], "rb").read()
+    if len(dump) < NCPU * BUFSIZE:
+        sys.exit("%s: %d bytes, expected %d" %
+                 (args[0], len(dump), NCPU * BUFSIZE))
+
+    events = []
+    for cpu in range(NCPU):
+        base = cpu * BUFSIZE
+        head, = struct.unpack_from("<I", dump, base)
+        for i in range(max(0, head - KTRACE_NENTS), head):
+            ent = ENT.unpack_from(dump, base + 4 +
+                                  (i % KTRACE_NENTS) * ENT.size)
+            events.append((ent[0], cpu, ent[1], ent[2:]))
+    events.sort()
+
+    t0 = events[0][0] if events else 0
+    for tsc, cpu, fmt, evargs in events:
+        print("cpu%d %12d  %s" % (cpu, tsc - t0,
+                                  cformat(image, image.string(fmt), evargs)))
+
+
+if __name__ == "__main__":
+    main()